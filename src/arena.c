@@ -0,0 +1,105 @@
+/*
+ * arena.c
+ * Bump-pointer allocator: many small objects freed all at once
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include "crxprof.h"
+
+#define ARENA_ALIGN         sizeof(void *)
+#define ARENA_FIRST_BLOCK   4096            /* trees of short threads are small */
+#define ARENA_MAX_BLOCK     (1024 * 1024)
+
+struct arena_block {
+    struct arena_block *prev;
+    char data[];
+};
+
+
+void
+arena_init(mem_arena *arena)
+{
+    arena->last = NULL;
+    arena->pos = arena->end = NULL;
+    arena->next_size = ARENA_FIRST_BLOCK;
+}
+
+
+static struct arena_block *
+new_block(size_t size)
+{
+    struct arena_block *b = (struct arena_block *)malloc(sizeof(struct arena_block) + size);
+    if (!b)
+        err(1, "Failed to allocate %zu bytes", size);
+    return b;
+}
+
+
+void *
+arena_alloc(mem_arena *arena, size_t size)
+{
+    void *ptr;
+
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    if ((size_t)(arena->end - arena->pos) < size) {
+        struct arena_block *b;
+
+        if (size > arena->next_size / 4) {
+            /* big one gets own block behind current: don't waste rest of it */
+            b = new_block(size);
+            if (arena->last) {
+                b->prev = arena->last->prev;
+                arena->last->prev = b;
+            }
+            else {
+                b->prev = NULL;
+                arena->last = b;
+            }
+            return b->data;
+        }
+
+        b = new_block(arena->next_size);
+        b->prev = arena->last;
+        arena->last = b;
+        arena->pos = b->data;
+        arena->end = b->data + arena->next_size;
+        if (arena->next_size < ARENA_MAX_BLOCK)
+            arena->next_size *= 2;
+    }
+
+    ptr = arena->pos;
+    arena->pos += size;
+    return ptr;
+}
+
+
+void *
+arena_calloc(mem_arena *arena, size_t size)
+{
+    return memset(arena_alloc(arena, size), 0, size);
+}
+
+
+char *
+arena_strdup(mem_arena *arena, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    return (char *)memcpy(arena_alloc(arena, len), s, len);
+}
+
+
+void
+arena_free(mem_arena *arena)
+{
+    struct arena_block *b = arena->last;
+
+    while (b) {
+        struct arena_block *prev = b->prev;
+        free(b);
+        b = prev;
+    }
+
+    arena_init(arena);
+}
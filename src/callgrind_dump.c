@@ -13,14 +13,16 @@
 
 static inline int
 fn2id(const fn_descr *pfn) {
-  assert(pfn >= g_fndescr);
-  return pfn - g_fndescr;
+  assert(pfn->id < g_nfndescr);
+  return pfn->id;
 }
 
 
 typedef struct {
-  char *fns_usemask;
+  const fn_descr **fns_used; /* by id */
   uint64_t total_cost;
+  bool instr;   /* positions: instr (--instr) */
+  bool lines;   /* positions: line (--dwarf) */
 } call_summary;
 
 static void
@@ -31,26 +33,98 @@ collect_summary(calltree_node *node, call_summary *ctx) {
     collect_summary(&node->childs[i], ctx); 
   }
   
-  ctx->fns_usemask[fn2id(node->pfn)] = 1;
+  ctx->fns_used[fn2id(node->pfn)] = node->pfn;
   ctx->total_cost += node->nself;
 }
 
 
+/* "instr line" position as declared in header, fake line 1 if none */
+static const char *
+position(const call_summary *summary, unsigned long addr, unsigned line,
+         char *buf, size_t size)
+{
+    if (summary->instr && summary->lines)
+        snprintf(buf, size, "0x%lx %u", addr, line);
+    else if (summary->instr)
+        snprintf(buf, size, "0x%lx", addr);
+    else if (summary->lines)
+        snprintf(buf, size, "%u", line);
+    else
+        snprintf(buf, size, "1");
+
+    return buf;
+}
+
+
+/*
+ * Address standing for function of node: pseudo-functions (inlined ones,
+ * [unknown in ...]) have none, so first position recorded in it is used.
+ */
+static unsigned long
+node_addr(const calltree_node *node)
+{
+    int i;
+
+    if (node->pfn->addr)
+        return node->pfn->addr;
+    if (node->nselfpos)
+        return node->selfpos[0].addr;
+    for (i = 0; i < node->nchilds; i++) {
+        if (node->childs[i].ncallpos)
+            return node->childs[i].callpos[0].addr;
+    }
+    return 0;
+}
+
+
 static void
 print_costs(const call_summary *summary, 
             const calltree_node *node, FILE *ofile)
 {
-    int i;
+    char pos[64];
+    int i, j;
 
+    if (summary->lines) {
+        const char *file = srcinfo_file(node->pfn);
+        fprintf(ofile, "fl=%s\n", file ? file : "???");
+    }
     fprintf(ofile, "fn=(%d)\n", fn2id(node->pfn));
-    fprintf(ofile, "1 %" PRIu64 "\n", node->nself);
+    if (node->nselfpos) {
+        for (i = 0; i < node->nselfpos; i++) {
+            const pos_cost *pc = &node->selfpos[i];
+            fprintf(ofile, "%s %" PRIu64 "\n",
+                position(summary, pc->addr, pc->line, pos, sizeof(pos)), pc->cost);
+        }
+    }
+    else
+        fprintf(ofile, "%s %" PRIu64 "\n", position(summary, node_addr(node), 0, pos, sizeof(pos)), node->nself);
 
     for (i = 0; i < node->nchilds; i++) {
         const calltree_node *child = &node->childs[i];
 
+        if (summary->lines) {
+            const char *cfile = srcinfo_file(child->pfn);
+            fprintf(ofile, "cfl=%s\n", cfile ? cfile : "???");
+        }
         fprintf(ofile, "cfn=(%d)\n", fn2id(child->pfn));
-        fprintf(ofile, "calls=%" PRIu64 " 1\n", child->nself + child->nintermediate);
-        fprintf(ofile, "1 %" PRIu64 "\n", child->nself + child->nintermediate);
+        if (!child->ncallpos) {
+            /* positions aren't kept (packed tree) */
+            fprintf(ofile, "calls=%" PRIu64 " %s\n", child->nself + child->nintermediate,
+                position(summary, node_addr(child), 0, pos, sizeof(pos)));
+            fprintf(ofile, "%s %" PRIu64 "\n",
+                position(summary, 0, 0, pos, sizeof(pos)), child->nself + child->nintermediate);
+            continue;
+        }
+
+        /* one call per site: callee name is given once */
+        for (j = 0; j < child->ncallpos; j++) {
+            const pos_cost *pc = &child->callpos[j];
+
+            fprintf(ofile, "calls=%" PRIu64 " %s\n", pc->cost,
+                position(summary, node_addr(child), 0, pos, sizeof(pos)));
+            fprintf(ofile, "%s %" PRIu64 "\n",
+                position(summary, pc->addr, pc->line, pos, sizeof(pos)), pc->cost);
+        }
     }
 
     for (i = 0; i < node->nchilds; i++) {
@@ -67,22 +141,40 @@ dump_callgrind(const ptrace_context *ctx, calltree_node *root, FILE *ofile)
 
   call_summary summary;
   summary.total_cost  = 0;
-  summary.fns_usemask = calloc(1, g_nfndescr);
-  assert(summary.fns_usemask);
-
-  collect_summary(root, &summary);
+  summary.instr = calltree_instr_tracked();
+  summary.lines = srcinfo_enabled();
+  summary.fns_used = calloc(g_nfndescr, sizeof(const fn_descr *));
+  assert(summary.fns_used);
+
+  /* root is synthetic: functions called from it are entry points */
+  for (i = 0; i < root->nchilds; i++)
+    collect_summary(&root->childs[i], &summary);
   fprintf(ofile, "cmd: %s\n", ctx->cmdline);
   fprintf(ofile, "pid: %d\n", ctx->pid);
   fprintf(ofile, "creator: %s-%s\n", PACKAGE_NAME, PACKAGE_VERSION);
+  if (summary.instr)
+    fprintf(ofile, "positions: instr%s\n", summary.lines ? " line" : "");
+  else if (summary.lines)
+    fprintf(ofile, "positions: line\n");
   fprintf(ofile, "events: Instructions\n"
           "summary: %" PRIu64"\n\n\n", summary.total_cost);
   
   for (i = 0; i < g_nfndescr; i++) {
-    if (summary.fns_usemask[i])
-      fprintf(ofile, "fn=(%d) %s\n", i, g_fndescr[i].name);
+    if (!summary.fns_used[i])
+      continue;
+    if (summary.lines) {
+      /* function is identified by file too */
+      const char *file = srcinfo_file(summary.fns_used[i]);
+      fprintf(ofile, "fl=%s\n", file ? file : "???");
+    }
+    fprintf(ofile, "fn=(%d) %s\n", i, fn_name(summary.fns_used[i]));
   }
-  free(summary.fns_usemask);
+  free(summary.fns_used);
 
-  print_costs(&summary, root, ofile);
+  for (i = 0; i < root->nchilds; i++) {
+    if (i > 0)
+      fprintf(ofile, "\n");
+    print_costs(&summary, &root->childs[i], ofile);
+  }
   fprintf(ofile, "\n\n");
 }
@@ -0,0 +1,380 @@
+/*
+ * calltree.c
+ * Accumulate backtraces into tree of calls
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include "crxprof.h"
+
+/*
+ * Few childs are scanned linearly, but dispatcher-like functions
+ * may have hundreds of callees: index them by open-addressing hash.
+ */
+#define CALLTREE_LINEAR_MAX  8
+
+static bool track_instr = false;
+
+static inline unsigned
+fn_hash(const fn_descr *pfn, unsigned mask)
+{
+    /* Fibonacci hashing of pointer */
+    return (unsigned)(((uintptr_t)pfn / sizeof(fn_descr)) * 2654435761u) & mask;
+}
+
+/* childs_index has childs_size*2 cells: index in childs + 1, 0 if empty */
+static void
+index_insert(calltree_node *parent, int ichild)
+{
+    unsigned mask = parent->childs_size * 2 - 1,
+             h = fn_hash(parent->childs[ichild].pfn, mask);
+
+    while (parent->childs_index[h])
+        h = (h + 1) & mask;
+
+    parent->childs_index[h] = ichild + 1;
+}
+
+static void
+rebuild_index(mem_arena *arena, calltree_node *parent)
+{
+    int i;
+
+    /* previous index (if any) stays in arena till tree is destroyed */
+    parent->childs_index = (int *)arena_calloc(arena, parent->childs_size * 2 * sizeof(int));
+
+    for (i = 0; i < parent->nchilds; i++)
+        index_insert(parent, i);
+}
+
+
+static calltree_node *
+find_child(const calltree_node *parent, const fn_descr *pfn)
+{
+    int i;
+
+    if (parent->childs_index) {
+        unsigned mask = parent->childs_size * 2 - 1,
+                 h = fn_hash(pfn, mask);
+
+        for (; parent->childs_index[h]; h = (h + 1) & mask) {
+            calltree_node *child = &parent->childs[parent->childs_index[h] - 1];
+            if (child->pfn == pfn)
+                return child;
+        }
+    }
+    else {
+        for (i = 0; i < parent->nchilds; i++)
+            if (parent->childs[i].pfn == pfn)
+                return &parent->childs[i];
+    }
+
+    return NULL;
+}
+
+
+static calltree_node *
+add_child(calltree *tree, calltree_node *parent, const fn_descr *pfn)
+{
+    mem_arena *arena = &tree->arena;
+    calltree_node *child;
+
+    if (parent->nchilds == parent->childs_size) {
+        calltree_node *childs;
+
+        /* geometric growth: abandoned arrays take less than used ones */
+        parent->childs_size = parent->childs_size ? parent->childs_size * 2 : 2;
+        childs = (calltree_node *)arena_alloc(arena,
+            sizeof(calltree_node) * parent->childs_size);
+        if (parent->nchilds)
+            memcpy(childs, parent->childs, sizeof(calltree_node) * parent->nchilds);
+        parent->childs = childs;
+
+        if (parent->childs_index)
+            rebuild_index(arena, parent);
+    }
+
+    child = &parent->childs[parent->nchilds++];
+    memset(child, 0, sizeof(calltree_node));
+    child->pfn = pfn;
+    child->seq = tree->nnodes++;
+
+    if (parent->childs_index)
+        index_insert(parent, parent->nchilds - 1);
+    else if (parent->nchilds > CALLTREE_LINEAR_MAX)
+        rebuild_index(arena, parent);
+
+    return child;
+}
+
+
+void
+calltree_init(calltree *tree)
+{
+    tree->root = NULL;
+    arena_init(&tree->arena);
+    tree->nnodes = 0;
+}
+
+
+/*
+ * Frames of IP of backtrace, innermost first. Return address is looked
+ * up as the call before it: call may be the last instruction of mapping.
+ */
+static int
+symbolize(unsigned long ip, bool is_return, src_frame *frames, bool *unknown)
+{
+    unsigned long pc = is_return ? ip - 1 : ip;
+    int n;
+
+    if (srcinfo_enabled())
+        n = srcinfo_expand(ip, is_return, frames, MAX_INLINE_DEPTH);
+    else {
+        frames[0].pfn = lookup_fn_descr(pc);
+        frames[0].line = 0;
+        n = frames[0].pfn ? 1 : 0;
+    }
+
+    *unknown = (n == 0);
+    if (*unknown) {
+        /* no symbol: account to mapping as a whole */
+        frames[0].pfn = unknown_fn_descr(pc);
+        frames[0].line = 0;
+        n = 1;
+    }
+    return n;
+}
+
+
+/* add cost at position to list of them (selfpos or callpos of node) */
+static void
+add_pos(mem_arena *arena, pos_cost **plist, int *pn, int *psize,
+        unsigned long addr, unsigned line, uint64_t cost)
+{
+    int i;
+
+    for (i = 0; i < *pn; i++) {
+        if ((*plist)[i].addr == addr && (*plist)[i].line == line) {
+            (*plist)[i].cost += cost;
+            return;
+        }
+    }
+
+    if (*pn == *psize) {
+        pos_cost *list;
+
+        *psize = *psize ? *psize * 2 : 2;
+        list = (pos_cost *)arena_alloc(arena, sizeof(pos_cost) * *psize);
+        if (*pn)
+            memcpy(list, *plist, sizeof(pos_cost) * *pn);
+        *plist = list;
+    }
+
+    (*plist)[*pn].addr = addr;
+    (*plist)[*pn].line = line;
+    (*plist)[(*pn)++].cost = cost;
+}
+
+
+void
+calltree_track_instr(bool on)
+{
+    track_instr = on;
+}
+
+
+bool
+calltree_instr_tracked()
+{
+    return track_instr;
+}
+
+
+static calltree_node *
+get_root(calltree *tree)
+{
+    if (!tree->root) {
+        tree->root = (calltree_node *)arena_calloc(&tree->arena, sizeof(calltree_node));
+        tree->root->pfn = fn_named("[root]");
+        tree->root->seq = tree->nnodes++;
+    }
+    return tree->root;
+}
+
+
+/* callee `pfn' of `parent' called at addr/line: cost passes through parent */
+static calltree_node *
+add_call(calltree *tree, calltree_node *parent, const fn_descr *pfn,
+         unsigned long addr, unsigned line, uint64_t cost)
+{
+    calltree_node *node = find_child(parent, pfn);
+
+    if (!node)
+        node = add_child(tree, parent, pfn);
+    if (track_instr || srcinfo_enabled())
+        add_pos(&tree->arena, &node->callpos, &node->ncallpos, &node->callpos_size,
+                addr, line, cost);
+
+    parent->nintermediate += cost;
+    return node;
+}
+
+
+/*
+ * Account backtrace to `tree' and to `thread_tree' (if not NULL):
+ * IPs are symbolized once for both.
+ */
+drop_reason
+fill_backtrace(uint64_t cost, uint64_t nsnaps, const trace_stack *stk,
+               calltree *tree, calltree *thread_tree)
+{
+    calltree *trees[2] = { tree, thread_tree };
+    calltree_node *parents[2];
+    src_frame frames[MAX_INLINE_DEPTH];
+    unsigned long addr = 0; /* position of parent */
+    unsigned line = 0;
+    int depth = stk->depth - 1, ntrees = thread_tree ? 2 : 1, t;
+
+    if (stk->depth <= 0 || stk->depth >= MAX_STACK_DEPTH) {
+        // too small size of ips. So, we don't have start frame here.
+        // Simply ignore
+        return DROP_BAD_STACK;
+    }
+
+    for (t = 0; t < ntrees; t++)
+        parents[t] = get_root(trees[t]);
+
+    while (depth >= 0) {
+        bool unknown;
+        int n = symbolize(stk->ips[depth], depth > 0, frames, &unknown);
+        unsigned long ip = track_instr ? stk->ips[depth] : 0;
+
+        depth--;
+        while (n-- > 0) {
+            const fn_descr *pfn = frames[n].pfn;
+            bool collapsed = unknown && parents[0]->pfn == pfn;
+
+            /* calls inside of stripped library: position is the innermost one */
+            if (!collapsed) {
+                for (t = 0; t < ntrees; t++)
+                    parents[t] = add_call(trees[t], parents[t], pfn, addr, line, cost);
+            }
+            addr = ip;
+            line = frames[n].line;
+        }
+    }
+
+    for (t = 0; t < ntrees; t++) {
+        parents[t]->nself += cost;
+        parents[t]->nsnaps += nsnaps;
+        if (track_instr || srcinfo_enabled())
+            add_pos(&trees[t]->arena, &parents[t]->selfpos, &parents[t]->nselfpos,
+                    &parents[t]->selfpos_size, addr, line, cost);
+    }
+
+    return DROP_NONE;
+}
+
+
+static int
+count_nodes(const calltree_node *node)
+{
+    int i, n = 1;
+
+    for (i = 0; i < node->nchilds; i++)
+        n += count_nodes(&node->childs[i]);
+    return n;
+}
+
+
+static int
+pack_node(const calltree_node *node, int depth, packed_node *nodes, int n)
+{
+    packed_node *p = &nodes[n++];
+    int i;
+
+    p->pfn = node->pfn;
+    p->nself = node->nself;
+    p->nsnaps = node->nsnaps;
+    p->depth = depth;
+
+    for (i = 0; i < node->nchilds; i++)
+        n = pack_node(&node->childs[i], depth + 1, nodes, n);
+    return n;
+}
+
+
+/*
+ * Tree as array of nodes in preorder: much smaller than tree itself.
+ * Costs by position (--dwarf, --instr) are not kept.
+ */
+packed_node *
+calltree_pack(const calltree *tree, int *pnnodes)
+{
+    packed_node *nodes;
+
+    *pnnodes = 0;
+    if (!tree->root)
+        return NULL;
+
+    *pnnodes = count_nodes(tree->root);
+    nodes = (packed_node *)malloc(sizeof(packed_node) * *pnnodes);
+    if (!nodes)
+        err(1, "Failed to allocate %d packed nodes", *pnnodes);
+
+    (void)pack_node(tree->root, 0, nodes, 0);
+    return nodes;
+}
+
+
+/*
+ * Add packed tree to `tree' (summing costs of same paths).
+ * Returns false if nodes aren't a preorder of tree.
+ */
+bool
+calltree_unpack(calltree *tree, const packed_node *nodes, int nnodes)
+{
+    calltree_node *path[MAX_PACKED_DEPTH];
+    int i, k, last_depth = -1;
+
+    for (i = 0; i < nnodes; i++) {
+        const packed_node *p = &nodes[i];
+        calltree_node *node;
+
+        if (p->depth < 0 || p->depth > last_depth + 1 || p->depth >= MAX_PACKED_DEPTH)
+            return false;
+        last_depth = p->depth;
+
+        if (p->depth == 0) {
+            if (!tree->root) {
+                tree->root = (calltree_node *)arena_calloc(&tree->arena, sizeof(calltree_node));
+                tree->root->pfn = p->pfn;
+                tree->root->seq = tree->nnodes++;
+            }
+            node = tree->root;
+        }
+        else {
+            /* childs array of parent may move, but not parent itself */
+            node = find_child(path[p->depth - 1], p->pfn);
+            if (!node)
+                node = add_child(tree, path[p->depth - 1], p->pfn);
+        }
+
+        node->nself += p->nself;
+        node->nsnaps += p->nsnaps;
+        for (k = 0; k < p->depth; k++)
+            path[k]->nintermediate += p->nself;
+        path[p->depth] = node;
+    }
+
+    return true;
+}
+
+
+void
+calltree_destroy(calltree *tree) {
+    arena_free(&tree->arena);
+    tree->root = NULL;
+    tree->nnodes = 0;
+}
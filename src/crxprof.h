@@ -5,17 +5,60 @@
 #include <stdint.h>
 #include <stdio.h>
 #include "../config.h"
+#include "ptime.h"
 
 #define DEFAULT_MINCOST         5.0 /* % */
 #define DEFAULT_FREQ            100
 #define MAX_STACK_DEPTH         128
+#define DEFAULT_NWINDOWS        12  /* --window: windows kept in memory */
 
+/* bump allocator, see arena.c */
 typedef struct {
-    char         *name;
+    struct arena_block *last;
+    char *pos, *end;      /* free space of last block */
+    size_t next_size;
+} mem_arena;
+
+
+typedef struct {
+    char         *name; /* mangled, see fn_name() */
     unsigned long addr;
     unsigned int  len;
+    int           id;   /* unique number of loaded function */
 } fn_descr;
 
+/* mmapped file of symbol cache */
+typedef struct {
+    void *addr;
+    size_t size;
+} symcache_map;
+
+/* executable mapping of process, symbols are read on first use */
+typedef struct {
+    unsigned long start, end;
+    off_t offset;
+    char *path;
+    bool is_exe;
+    bool special;           /* [vdso], anonymous etc: no symbols */
+    bool loaded;
+    bool cached;            /* read from symbol cache */
+
+    fn_descr *fns;          /* sorted by addr */
+    int nfns;
+    unsigned long *eytz;    /* search index of fns */
+    int *eytz_idx;
+    symcache_map symcache;  /* names of fns if read from cache */
+    void *elf;              /* elf_reader_t: names of fns if read from ELF */
+    const fn_descr *unknown; /* stands for code without symbols */
+} fn_module;
+
+
+/* cost at position in function (--dwarf, --instr) */
+typedef struct {
+    unsigned long addr; /* IP if --instr, 0 otherwise */
+    unsigned line;      /* source line if --dwarf, 0 otherwise */
+    uint64_t cost;
+} pos_cost;
 
 struct st_calltree_node;
 
@@ -23,59 +66,275 @@ typedef struct st_calltree_node {
     const fn_descr *pfn;
     uint64_t nintermediate;
     uint64_t nself;
+    uint64_t nsnaps;         /* snapshots accounted to nself */
 
     struct st_calltree_node *childs;
     int nchilds;
+    int childs_size;    /* allocated childs */
+    int *childs_index;  /* hash of childs by pfn, NULL for few childs */
+
+    pos_cost *callpos;       /* cost by call site in parent (--dwarf, --instr) */
+    int ncallpos;
+    int callpos_size;
+    pos_cost *selfpos;       /* nself by position (--dwarf, --instr) */
+    int nselfpos;
+    int selfpos_size;
+    int seq;                 /* order of creation in tree, root is 0 */
 } calltree_node;
 
+/*
+ * Nodes of tree are allocated from its arena and freed at once.
+ * Root is synthetic: outermost frames of backtraces (main, thread
+ * start routines, signal handlers...) are its childs.
+ */
+typedef struct {
+    calltree_node *root;
+    mem_arena arena;
+    int nnodes;         /* seq of nodes are less */
+} calltree;
+
+/* cost of node (by seq) when it was read last time, see dump_folded() */
+typedef struct {
+    const fn_descr *pfn;
+    uint64_t nself;
+} seen_cost;
+
+
+/* node of calltree packed in preorder (see calltree_pack), no positions */
+typedef struct {
+    const fn_descr *pfn;
+    uint64_t nself;
+    uint64_t nsnaps;
+    int depth;          /* 0 - root */
+} packed_node;
+
+#define MAX_PACKED_DEPTH        (MAX_STACK_DEPTH * MAX_INLINE_DEPTH + 1)
+
+
+/* frame of IP expanded by inlined functions, see srcinfo.c */
+typedef struct {
+    const fn_descr *pfn;
+    unsigned line;      /* 0 if unknown */
+} src_frame;
+
+#define MAX_INLINE_DEPTH        16  /* frames of one IP */
 
 typedef struct {
     unw_word_t ips[MAX_STACK_DEPTH];
     int depth;
 } trace_stack ;
 
+/* unique backtrace recorded by stackrec.c */
+typedef struct {
+    pid_t tid;
+    uint32_t hash;
+    uint64_t cost;
+    uint64_t nsnaps;
+    int depth;
+    unw_word_t ips[];
+} raw_stack;
+
+typedef struct {
+    raw_stack **stacks;
+    int nstacks;
+    int size;
+    int *index;        /* hash of stacks */
+    mem_arena arena;   /* raw_stack's themselves */
+} stack_store;
+
+typedef struct {
+    pid_t tid;
+    void *unwind_rctx;
+    struct proc_timer ptime;
+    char procstat_path[sizeof("/proc/4000000000/task/4000000000/stat")];
+    bool exited;
+
+    int perf_fd;      /* perf_event sampling: -1 if ptrace used */
+    void *perf_buf;   /* mmapped ring buffer of perf_fd */
+    bool seen;        /* still listed in /proc/pid/task (perf mode) */
+    bool just_cloned; /* first stop (SIGSTOP of clone) isn't reported yet */
+
+    calltree tree;    /* profile of this thread only */
+    uint64_t nsnaps;
+    uint64_t nsnaps_accounted;
+} thread_context;
+
+typedef enum { UNWIND_LIBUNWIND, UNWIND_FP } unwind_method_t;
+
+/* why backtrace isn't accounted */
+typedef enum {
+    DROP_NONE = 0,
+    DROP_BAD_STACK,    /* empty or too deep to have start frame */
+    DROP_LOST,         /* lost by kernel (perf buffer overflow) */
+    NDROP_REASONS
+} drop_reason;
+
 typedef struct {
     pid_t pid;
+    crxprof_method prof_method;
+    unwind_method_t unwind_method;
+    bool use_perf;         /* sample with perf_event_open instead of ptrace */
+    bool defer_symbols;    /* record raw stacks, build calltrees on demand */
+    unsigned perf_freq;
+    uint64_t period_ns;    /* sampling interval */
     unw_addr_space_t addr_space;
-    void *unwind_rctx;
+    pid_t stop_tid;   /* thread reported by last wait */
     int stop_signal;
+    int stop_event;   /* PTRACE_EVENT_* of last stop, 0 - signal */
 
-    char procstat_path[sizeof("/proc/4000000000/stat")];
     char *cmdline;
+    time_t started;        /* when profile (or its window) is started */
+    time_t ended;          /* when snapshot shown is saved, 0 - profile is live */
     trace_stack stk;
+    stack_store raw;       /* recorded stacks if defer_symbols */
+
+    thread_context **threads;
+    int nthreads;
 
     uint64_t nsnaps;
     uint64_t nsnaps_accounted;
+    uint64_t ndropped[NDROP_REASONS];
+    uint64_t nfp_fallbacks;   /* broken frame-pointer chains unwound by libunwind */
 } ptrace_context;
 
+/* profile of time window (--window), see window.c */
+typedef struct {
+    packed_node *nodes;
+    int nnodes;
+    time_t start, end;
+    uint64_t nsnaps;
+    uint64_t nsnaps_accounted;
+    uint64_t ndropped[NDROP_REASONS];
+} profile_window;
+
+/* last windows, oldest one first */
+typedef struct {
+    profile_window *windows;
+    int size, count, first;
+    uint64_t nsnaps_closed;  /* snapshots of all windows closed, even gone ones */
+} window_ring;
+
 typedef struct {
     unsigned max_depth;
     double min_cost;
     bool print_fullstack;
+    bool per_thread;
+    bool annotate_instr;
 } vproperties;
 
 
-extern fn_descr *g_fndescr;
-extern int g_nfndescr;
+extern fn_module *g_modules;  /* sorted by start */
+extern int g_nmodules;
+extern int g_nfndescr;        /* loaded functions: ids are less */
 
 typedef int (*qsort_compar_t)(const void *, const void *);
 
 /* fndescr-related functions */
 void init_fndescr(pid_t pid);
+void init_fndescr_offline(); /* no process: functions of snapshot only */
+void sync_fndescr(); /* re-read maps of process right now */
+void load_fndescr(fn_module *mod);
+void load_fndescr_many(fn_module **mods, int nmods); /* in parallel */
+fn_module *find_module(unsigned long ip);
+const fn_module *fn_module_of(const fn_descr *pfn);
+unsigned long module_elf_addr(const fn_module *mod, unsigned long ip);
+const char *fn_name(const fn_descr *pfn); /* demangled */
+const fn_descr *fn_named(const char *name); /* pseudo-function, e.g. inlined one */
+void reclaim_fndescr(char *used); /* free functions not used (by id) */
 void free_fndescr();
+const fn_descr *lookup_fn_descr(unsigned long ip);
+const fn_descr *unknown_fn_descr(unsigned long ip); /* "[unknown in lib]" */
+
+/* on-disk symbol cache */
+void symcache_init(const char *dir); /* NULL - default location */
+void symcache_free();
+bool symcache_load(const char *elfpath, bool dynamic, symcache_map *scm,
+                   fn_descr **psyms, int *pnsyms);
+void symcache_unmap(symcache_map *scm);
+void symcache_save(const char *elfpath, bool dynamic, const fn_descr *syms, int nsyms);
+
+/* DWARF: inlined functions and source lines */
+bool srcinfo_init(pid_t pid);
+bool srcinfo_enabled();
+int srcinfo_expand(unsigned long ip, bool is_return, src_frame *frames, int max); /* innermost first */
+const char *srcinfo_file(const fn_descr *pfn); /* NULL if unknown */
+void srcinfo_refresh(); /* modules of process changed */
+void srcinfo_reclaim(const char *used); /* forget resolved IPs, files of unused ids */
+void srcinfo_free();
 
 /* ptrace-related functions */
-bool trace_init(pid_t pid, ptrace_context *ctx);
+bool trace_init(pid_t pid, crxprof_method method, ptrace_context *ctx);
 void trace_free(ptrace_context *ctx);
-bool get_backtrace(ptrace_context *ctx);
-bool fill_backtrace(uint64_t cost, const trace_stack *stk, 
-                    calltree_node **root);
-void calltree_destroy(calltree_node *root);
-char get_procstate(const ptrace_context *ctx); /* One character from the string "RSDZTW" */
+thread_context *trace_add_thread(ptrace_context *ctx, pid_t tid);
+thread_context *trace_find_thread(const ptrace_context *ctx, pid_t tid);
+void trace_thread_exited(ptrace_context *ctx, thread_context *thr);
+void trace_reset(ptrace_context *ctx); /* forget samples taken (next window) */
+bool get_backtrace(ptrace_context *ctx, thread_context *thr);
+char get_procstate(const thread_context *thr); /* One character from the string "RSDZTW" */
+
+/* calltree-related functions */
+void calltree_init(calltree *tree);
+void calltree_track_instr(bool on); /* keep IPs of leaf frames */
+bool calltree_instr_tracked();
+drop_reason fill_backtrace(uint64_t cost, uint64_t nsnaps, const trace_stack *stk,
+                           calltree *tree, calltree *thread_tree); /* thread_tree may be NULL */
+packed_node *calltree_pack(const calltree *tree, int *pnnodes); /* malloc'ed */
+bool calltree_unpack(calltree *tree, const packed_node *nodes, int nnodes); /* adds costs */
+void calltree_destroy(calltree *tree);
+
+/* raw stacks recording */
+void stackrec_init(stack_store *store);
+void stackrec_destroy(stack_store *store);
+bool stackrec_add(stack_store *store, pid_t tid, uint64_t cost, const trace_stack *stk);
+void stackrec_aggregate(ptrace_context *ctx, calltree *tree);
+void account_backtrace(ptrace_context *ctx, thread_context *thr, pid_t tid,
+                       uint64_t cost, calltree *tree);
+
+/* rolling windows of profile */
+void window_ring_init(window_ring *ring, int size);
+void window_push(window_ring *ring, const ptrace_context *ctx, const calltree *tree,
+                 time_t start, time_t end);
+void window_merge(const window_ring *ring, ptrace_context *view, calltree *tree); /* adds counters */
+void window_reclaim(const window_ring *ring); /* free symbols windows don't refer */
+void window_ring_free(window_ring *ring);
+
+/* arena allocator */
+void arena_init(mem_arena *arena);
+void *arena_alloc(mem_arena *arena, size_t size);
+void *arena_calloc(mem_arena *arena, size_t size);
+char *arena_strdup(mem_arena *arena, const char *s);
+void arena_free(mem_arena *arena);
+
+/* libunwind accessors caching memory of stopped thread (remote_mem.c) */
+unw_accessors_t *rmem_accessors();
+void *rmem_create(pid_t tid);
+void rmem_destroy(void *arg);
+void *rmem_begin(void *arg); /* returns arg for unw_init_remote */
+
+/* perf_event-related functions */
+bool perf_attach(ptrace_context *ctx);
+bool perf_collect(ptrace_context *ctx, calltree *tree); /* false if process gone */
+bool perf_open_thread(const ptrace_context *ctx, thread_context *thr);
+void perf_close_thread(thread_context *thr);
 
 /* visualize and dumps */
 void visualize_profile(calltree_node *root, const vproperties *vprops);
+void annotate_instr(calltree_node *root, const vproperties *vprops);
 void dump_callgrind(const ptrace_context *ctx, calltree_node *root, FILE *ofile);
+void dump_folded(const calltree_node *root, seen_cost *seen, FILE *ofile); /* cost since seen */
+void dump_flamegraph(const ptrace_context *ctx, calltree_node *root, FILE *ofile); /* SVG */
+bool dump_pprof(const ptrace_context *ctx, calltree_node *root, FILE *ofile); /* gzipped */
+bool dump_snapshot(const ptrace_context *ctx, calltree_node *root, FILE *ofile); /* binary */
+
+/* binary snapshot viewed offline (--view) */
+bool snapshot_load(const char *path, ptrace_context *ctx, calltree *tree);
+void snapshot_free(ptrace_context *ctx);
+
+/* profile served over unix socket */
+bool stream_open(const char *path);
+void stream_poll(ptrace_context *ctx, calltree *tree); /* serve clients waiting */
+void stream_reset(); /* profile is started from scratch */
+void stream_close();
 
 
 void print_message(const char *fmt, ...) __attribute__((__format__(printf, 1, 2)));
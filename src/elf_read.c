@@ -1,123 +1,246 @@
 /*
  * elf_read.c
  *
- * Extract functions from ELF file using libbfd (binutils)
+ * Extract functions from ELF file: file is mmapped and symbol table
+ * (.symtab or .dynsym) is walked in place, names are not copied.
  */
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <stdlib.h>
-#include <assert.h>
-#include <bfd.h>
+#include <string.h>
+#include <endian.h>
+#include <elf.h>
 
 #include "symbols.h"
 
-/* internal BFD structure we need to extract size of symbol */
-struct elf_internal_sym {
-  bfd_vma       st_value;               /* Value of the symbol */
-  bfd_vma       st_size;                /* Associated symbol size */
-  unsigned long st_name;                /* Symbol name, index in string tbl */
-  unsigned char st_info;                /* Type and binding attributes */
-  unsigned char st_other;               /* Visibilty, and target specific */
-  unsigned char st_target_internal;     /* Internal-only information */
-  unsigned int  st_shndx;               /* Associated section index */
-};
-
-#define BFD_GET_SYMBOL_SIZE(psymbol) ( ((struct elf_internal_sym *)((char *)psymbol + sizeof(asymbol)))->st_size )
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#define NATIVE_ELFDATA  ELFDATA2LSB
+#else
+#define NATIVE_ELFDATA  ELFDATA2MSB
+#endif
+
 typedef enum { READSYMBOLS_TEXT, READSYMBOLS_DYNA } elfread_src_t;
 
 
 void
 elfreader_init()
 {
-    bfd_init();
 }
 
-static int
+
+/* section header of both classes */
+static bool
+get_section(const elf_reader_t *reader, unsigned i, Elf64_Shdr *sh)
+{
+    if (i >= reader->__nsections)
+        return false;
+
+    if (reader->__is64) {
+        *sh = ((const Elf64_Shdr *)reader->__sections)[i];
+    }
+    else {
+        const Elf32_Shdr *sh32 = &((const Elf32_Shdr *)reader->__sections)[i];
+        sh->sh_name      = sh32->sh_name;
+        sh->sh_type      = sh32->sh_type;
+        sh->sh_flags     = sh32->sh_flags;
+        sh->sh_addr      = sh32->sh_addr;
+        sh->sh_offset    = sh32->sh_offset;
+        sh->sh_size      = sh32->sh_size;
+        sh->sh_link      = sh32->sh_link;
+        sh->sh_info      = sh32->sh_info;
+        sh->sh_addralign = sh32->sh_addralign;
+        sh->sh_entsize   = sh32->sh_entsize;
+    }
+    return true;
+}
+
+
+static bool
+in_file(const elf_reader_t *reader, uint64_t offset, uint64_t size)
+{
+    return offset <= reader->__map_size && size <= reader->__map_size - offset;
+}
+
+
+static bool
 elf_read_symbols(elf_reader_t *reader, const char *path, elfread_src_t srcsec)
 {
-    int i, nsymbols, nfiltered, iflt;
-    size_t storage_needed;
+    const unsigned char *ident;
+    Elf64_Shdr symsh, strsh;
+    uint64_t shoff;
+    unsigned i, shentsize;
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return false;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(Elf32_Ehdr)) {
+        close(fd);
+        return false;
+    }
+
+    reader->__map_size = st.st_size;
+    reader->__map = mmap(NULL, reader->__map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (reader->__map == MAP_FAILED) {
+        reader->__map = NULL;
+        return false;
+    }
 
-    reader->__abfd = bfd_openr(path, NULL);
-    if (!reader->__abfd)
-        return -1;
+    ident = (const unsigned char *)reader->__map;
+    if (memcmp(ident, ELFMAG, SELFMAG) || ident[EI_DATA] != NATIVE_ELFDATA)
+        return false;
 
-    bfd_check_format(reader->__abfd, bfd_object);
-    storage_needed = (srcsec == READSYMBOLS_TEXT) ? 
-        bfd_get_symtab_upper_bound(reader->__abfd) :
-        bfd_get_dynamic_symtab_upper_bound(reader->__abfd);
+    if (ident[EI_CLASS] == ELFCLASS64) {
+        const Elf64_Ehdr *eh = (const Elf64_Ehdr *)reader->__map;
+        if (reader->__map_size < sizeof(Elf64_Ehdr))
+            return false;
+        reader->__is64 = true;
+        shoff = eh->e_shoff;
+        shentsize = eh->e_shentsize;
+        reader->__nsections = eh->e_shnum;
+        if (shentsize != sizeof(Elf64_Shdr))
+            return false;
+    }
+    else if (ident[EI_CLASS] == ELFCLASS32) {
+        const Elf32_Ehdr *eh = (const Elf32_Ehdr *)reader->__map;
+        reader->__is64 = false;
+        shoff = eh->e_shoff;
+        shentsize = eh->e_shentsize;
+        reader->__nsections = eh->e_shnum;
+        if (shentsize != sizeof(Elf32_Shdr))
+            return false;
+    }
+    else
+        return false;
 
-    if (storage_needed <= 0) {
-        return -1;
+    if (!in_file(reader, shoff, (uint64_t)reader->__nsections * shentsize))
+        return false;
+    reader->__sections = (const char *)reader->__map + shoff;
+
+    for (i = 0; get_section(reader, i, &symsh); i++) {
+        if (symsh.sh_type == (srcsec == READSYMBOLS_TEXT ? SHT_SYMTAB : SHT_DYNSYM))
+            break;
     }
-    
-    reader->__symbol_table = (asymbol**)malloc(storage_needed);
-    if (!reader->__symbol_table)
-        return -1;
-
-    nsymbols = (srcsec == READSYMBOLS_TEXT) ? 
-        bfd_canonicalize_symtab(reader->__abfd, reader->__symbol_table) : 
-        bfd_canonicalize_dynamic_symtab(reader->__abfd, reader->__symbol_table);
-
-    if (nsymbols < 0)
-        return -1;
-
-    nfiltered = 0;
-    for (i = 0; i < nsymbols; i++) {
-        if (reader->__symbol_table[i]->flags & (BSF_FUNCTION | BSF_GLOBAL))
-            nfiltered++;
+
+    /* stripped: no symbols, but it's not an error */
+    if (i == reader->__nsections)
+        return true;
+
+    if (!get_section(reader, symsh.sh_link, &strsh) ||
+        !in_file(reader, symsh.sh_offset, symsh.sh_size) ||
+        !in_file(reader, strsh.sh_offset, strsh.sh_size) ||
+        symsh.sh_entsize != (reader->__is64 ? sizeof(Elf64_Sym) : sizeof(Elf32_Sym)))
+    {
+        return false;
     }
 
-    reader->symbols = (elf_symbol_t *)malloc(nfiltered * sizeof(elf_symbol_t));
-    if (!reader->symbols)
-        return -1;
+    reader->__symbols = (const char *)reader->__map + symsh.sh_offset;
+    reader->__strtab = (const char *)reader->__map + strsh.sh_offset;
+    reader->__strtab_size = strsh.sh_size;
+    reader->nsymbols = symsh.sh_size / symsh.sh_entsize;
+    return true;
+}
+
 
-    for (i = 0, iflt = 0; i < nsymbols && iflt < nfiltered; i++) {
-        asymbol *is = reader->__symbol_table[i];
+/* nm-like class of symbol; only ones we need are exact ('T', 't', 'W', 'i') */
+static char
+symbol_class(const elf_reader_t *reader, unsigned char info, unsigned shndx)
+{
+    Elf64_Shdr sh;
+    unsigned char bind = ELF64_ST_BIND(info), type = ELF64_ST_TYPE(info);
+
+    if (shndx == SHN_UNDEF)
+        return (bind == STB_WEAK) ? 'w' : 'U';
+    if (type == STT_GNU_IFUNC)
+        return 'i'; /* value is resolver, not function itself */
+    if (bind == STB_WEAK)
+        return (type == STT_OBJECT) ? 'V' : 'W';
+    if (shndx >= SHN_LORESERVE || !get_section(reader, shndx, &sh))
+        return '?';
+    if (sh.sh_flags & SHF_EXECINSTR)
+        return (bind == STB_LOCAL) ? 't' : 'T';
 
-        if (is->flags & (BSF_FUNCTION | BSF_GLOBAL)) {
-            elf_symbol_t *os = reader->symbols + iflt++;
-            os->symbol_name   = (const char *)bfd_asymbol_name(is);
-            os->symbol_value  = bfd_asymbol_value(is);
-            os->symbol_size   = BFD_GET_SYMBOL_SIZE(is);
-            os->symbol_class  = (char)bfd_decode_symclass(is);
+    return (bind == STB_LOCAL) ? 'd' : 'D';
+}
+
+
+/*
+ * Next function or global symbol. Returns false at the end of table.
+ * Name points into mmapped file: valid till elfreader_close.
+ */
+bool
+elf_read_next(elf_reader_t *reader, elf_symbol_t *sym)
+{
+    while (reader->__next < reader->nsymbols) {
+        int i = reader->__next++;
+        unsigned char info;
+        unsigned shndx;
+        uint64_t name;
+
+        if (reader->__is64) {
+            const Elf64_Sym *s = &((const Elf64_Sym *)reader->__symbols)[i];
+            info = s->st_info;
+            shndx = s->st_shndx;
+            name = s->st_name;
+            sym->symbol_value = s->st_value;
+            sym->symbol_size = s->st_size;
+        }
+        else {
+            const Elf32_Sym *s = &((const Elf32_Sym *)reader->__symbols)[i];
+            info = s->st_info;
+            shndx = s->st_shndx;
+            name = s->st_name;
+            sym->symbol_value = s->st_value;
+            sym->symbol_size = s->st_size;
         }
+
+        if (ELF64_ST_TYPE(info) != STT_FUNC && ELF64_ST_BIND(info) != STB_GLOBAL)
+            continue;
+        if (name >= reader->__strtab_size)
+            continue;
+
+        sym->symbol_name = reader->__strtab + name;
+        sym->symbol_class = symbol_class(reader, info, shndx);
+        return true;
     }
 
-    assert(iflt == nfiltered);
-    return iflt;
+    return false;
 }
 
+
 static elf_reader_t *
 call_elf_read_symbols(const char *path, elfread_src_t srcsec)
 {
     elf_reader_t *reader = (elf_reader_t *)calloc(1, sizeof(elf_reader_t));
-    int n;
-    
+
     if (!reader)
         return NULL;
-    
-    n = elf_read_symbols(reader, path, srcsec);
-    if (n == -1) {
+
+    if (!elf_read_symbols(reader, path, srcsec)) {
         elfreader_close(reader);
         return NULL;
     }
 
-    reader->nsymbols = n;
+    /* names after last zero of (broken) string table aren't terminated */
+    while (reader->__strtab_size && reader->__strtab[reader->__strtab_size - 1] != '\0')
+        reader->__strtab_size--;
+
     return reader;
 }
 
-#define checked_free(x) do { if (x) free(x); } while(0)
 
 void
 elfreader_close(elf_reader_t *reader)
 {
     if (reader) {
-        checked_free(reader->symbols);
-        checked_free(reader->__symbol_table);
-        if (reader->__abfd) {
-            bfd_close(reader->__abfd);
-        }
-
+        if (reader->__map)
+            munmap(reader->__map, reader->__map_size);
         free(reader);
     }
 }
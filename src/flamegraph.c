@@ -0,0 +1,150 @@
+/*
+ * flamegraph.c
+ * Calltree as self-contained SVG flame graph: width of frame is its cost,
+ * callees are stacked above it. Layout is the tree itself, so output
+ * is linear in number of nodes drawn.
+ */
+
+#define __STDC_FORMAT_MACROS
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "crxprof.h"
+
+#define IMAGE_WIDTH     1200
+#define FRAME_HEIGHT    16
+#define FONT_SIZE       12
+#define CHAR_WIDTH      (FONT_SIZE * 0.59)
+#define PAD_TOP         36  /* title */
+#define PAD_SIDE        10
+#define PAD_BOTTOM      10
+#define MIN_WIDTH       0.1 /* px: narrower frames and their callees are omitted */
+
+typedef struct {
+    FILE *ofile;
+    double scale;      /* px per cost unit */
+    uint64_t total;
+    int height;
+} svg_context;
+
+
+static inline uint64_t
+total_cost(const calltree_node *node)
+{
+    return node->nself + node->nintermediate;
+}
+
+
+static int
+max_depth(const calltree_node *node, double scale)
+{
+    int i, depth = 0;
+
+    for (i = 0; i < node->nchilds; i++) {
+        const calltree_node *child = &node->childs[i];
+
+        if (total_cost(child) * scale >= MIN_WIDTH) {
+            int d = max_depth(child, scale) + 1;
+            if (d > depth)
+                depth = d;
+        }
+    }
+    return depth;
+}
+
+
+/* at most `max' chars of s (if max >= 0), escaped for XML */
+static void
+xml_write(FILE *ofile, const char *s, int max)
+{
+    for (; *s && max != 0; s++, max--) {
+        switch (*s) {
+            case '&':  fputs("&amp;", ofile);  break;
+            case '<':  fputs("&lt;", ofile);   break;
+            case '>':  fputs("&gt;", ofile);   break;
+            case '"':  fputs("&quot;", ofile); break;
+            default:   fputc(*s, ofile);
+        }
+    }
+}
+
+
+/* warm colors, stable for name: same function looks the same everywhere */
+static void
+frame_color(const char *name, int *r, int *g, int *b)
+{
+    uint32_t h = 2166136261u;
+
+    for (; *name; name++)
+        h = (h ^ (unsigned char)*name) * 16777619u;
+
+    *r = 205 + (int)(h % 51);
+    *g = (int)((h >> 8) % 231);
+    *b = (int)((h >> 16) % 56);
+}
+
+
+static void
+draw_node(const svg_context *svg, const calltree_node *node, int depth, double x)
+{
+    const char *name = fn_name(node->pfn);
+    double width = total_cost(node) * svg->scale;
+    int y = svg->height - PAD_BOTTOM - (depth + 1) * FRAME_HEIGHT, r, g, b, i, nchars;
+
+    if (width < MIN_WIDTH)
+        return;
+
+    frame_color(name, &r, &g, &b);
+    fprintf(svg->ofile, "<g><title>");
+    xml_write(svg->ofile, name, -1);
+    fprintf(svg->ofile, " (%.2f%%, %" PRIu64 " ns)</title>"
+        "<rect x=\"%.1f\" y=\"%d\" width=\"%.1f\" height=\"%d\" fill=\"rgb(%d,%d,%d)\" rx=\"2\"/>",
+        100.0 * total_cost(node) / svg->total, total_cost(node),
+        x, y, width, FRAME_HEIGHT - 1, r, g, b);
+
+    nchars = (int)((width - 6) / CHAR_WIDTH);
+    if (nchars >= 3) {
+        fprintf(svg->ofile, "<text x=\"%.1f\" y=\"%d\">", x + 3, y + FONT_SIZE);
+        if ((int)strlen(name) <= nchars)
+            xml_write(svg->ofile, name, -1);
+        else {
+            xml_write(svg->ofile, name, nchars - 2);
+            fputs("..", svg->ofile);
+        }
+        fputs("</text>", svg->ofile);
+    }
+    fputs("</g>\n", svg->ofile);
+
+    /* callees from the left, self time is the gap on the right */
+    for (i = 0; i < node->nchilds; i++) {
+        draw_node(svg, &node->childs[i], depth + 1, x);
+        x += total_cost(&node->childs[i]) * svg->scale;
+    }
+}
+
+
+void
+dump_flamegraph(const ptrace_context *ctx, calltree_node *root, FILE *ofile)
+{
+    svg_context svg;
+
+    svg.ofile = ofile;
+    svg.total = total_cost(root) ? total_cost(root) : 1;
+    svg.scale = (double)(IMAGE_WIDTH - 2 * PAD_SIDE) / svg.total;
+    svg.height = PAD_TOP + PAD_BOTTOM + (max_depth(root, svg.scale) + 1) * FRAME_HEIGHT;
+
+    fprintf(ofile, "<?xml version=\"1.0\" standalone=\"no\"?>\n"
+        "<svg version=\"1.1\" width=\"%d\" height=\"%d\" viewBox=\"0 0 %d %d\" "
+        "xmlns=\"http://www.w3.org/2000/svg\">\n"
+        "<style>text { font-family: monospace; font-size: %dpx; pointer-events: none; } "
+        "rect:hover { stroke: black; }</style>\n"
+        "<rect width=\"100%%\" height=\"100%%\" fill=\"#f8f8f8\"/>\n"
+        "<text x=\"%d\" y=\"24\" text-anchor=\"middle\" style=\"font-size: 16px\">",
+        IMAGE_WIDTH, svg.height, IMAGE_WIDTH, svg.height, FONT_SIZE, IMAGE_WIDTH / 2);
+    xml_write(ofile, ctx->cmdline ? ctx->cmdline : "", -1);
+    fputs("</text>\n", ofile);
+
+    draw_node(&svg, root, 0, PAD_SIDE);
+    fputs("</svg>\n", ofile);
+}
@@ -4,14 +4,113 @@
  */
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
 #include <err.h>
 #include "crxprof.h"
 #include "symbols.h"
 #include "liberty_stub.h"
 
-fn_descr *g_fndescr = NULL;
+/*
+ * Executable mappings are collected at start, but symbols of mapping
+ * are read only when some IP falls into it first time.
+ */
+fn_module *g_modules = NULL;
+int g_nmodules = 0;
+static int modules_size = 0;
 int g_nfndescr = 0;
 
+/* ids of freed functions, given out again: see reclaim_fndescr() */
+static int *free_ids = NULL;
+static int nfree_ids = 0, free_ids_size = 0;
+
+/*
+ * Maps are re-read when IP is out of known modules (dlopen), but not
+ * too often: interval grows while nothing changes.
+ */
+#define REFRESH_MIN_USEC   200000
+#define REFRESH_MAX_USEC   5000000
+
+static pid_t traced_pid;
+static char *exe_path;
+static uint64_t last_refresh, refresh_interval;
+
+/* unmapped (dlclose'd) modules: calltrees may still refer their functions */
+static fn_module *retired = NULL;
+static int nretired = 0, retired_size = 0;
+
+/* functions of JIT from /tmp/perf-PID.map, appended while process runs */
+static char jit_path[sizeof("/tmp/perf-4000000000.map")];
+static long jit_pos = 0;           /* read up to */
+static fn_descr **jit_fns = NULL;  /* sorted by addr, don't overlap */
+static int njit = 0, jit_size = 0;
+static fn_descr **jit_dropped = NULL;  /* redefined ones, till not referred */
+static int njit_dropped = 0, jit_dropped_size = 0;
+
+/* demangled names by fn_descr.id, filled on demand */
+static char **demangled = NULL;
+static int demangled_size = 0;
+
+/* pseudo-functions by name (open addressing), see fn_named() */
+static fn_descr **named = NULL;
+static int nnamed = 0, named_size = 0;
+static const fn_descr *unmapped_fn = NULL;  /* IPs out of any mapping */
+
+#define MAX_LOAD_THREADS  8
+
+/* direct-mapped cache: same IPs are met in nearly every backtrace */
+#define IP_CACHE_SIZE  4096 /* power of 2 */
+
+static struct ip_cache_entry {
+    unsigned long ip;
+    const fn_descr *pfn;
+} ip_cache[IP_CACHE_SIZE];
+
+
+static int
+alloc_fn_id()
+{
+    return nfree_ids ? free_ids[--nfree_ids] : g_nfndescr++;
+}
+
+
+static void
+release_fn_id(int id)
+{
+    if (nfree_ids == free_ids_size) {
+        free_ids_size = free_ids_size ? free_ids_size * 2 : 1024;
+        free_ids = (int *)realloc(free_ids, sizeof(int) * free_ids_size);
+        if (!free_ids)
+            err(1, "Failed to allocate %d ids", free_ids_size);
+    }
+    free_ids[nfree_ids++] = id;
+
+    if (id < demangled_size) {
+        free(demangled[id]);
+        demangled[id] = NULL;
+    }
+}
+
+
+/* descriptor and its name in one block: JIT and named functions */
+static fn_descr *
+new_fn_descr(const char *name, unsigned long addr, unsigned long len)
+{
+    size_t name_size = strlen(name) + 1;
+    fn_descr *pfn = (fn_descr *)malloc(sizeof(fn_descr) + name_size);
+
+    if (!pfn)
+        err(1, "Failed to allocate function %s", name);
+    pfn->name = memcpy(pfn + 1, name, name_size);
+    pfn->addr = addr;
+    pfn->len = len;
+    pfn->id = alloc_fn_id();
+    return pfn;
+}
+
+
 /* Order by addr ASC selecting shortest name if any aliases */
 static int
 fdescr_cmp(const fn_descr *a, const fn_descr *b)
@@ -22,116 +121,893 @@ fdescr_cmp(const fn_descr *a, const fn_descr *b)
 }
 
 
+/* sort by addr and remove aliases, returns new number of functions */
+static int
+uniq_fndescr(fn_descr *fns, int nfns) {
+    fn_descr *p  = fns,
+             *pw = fns;
+    int i;
+
+    if (!nfns)
+        return 0;
+
+    qsort(p, nfns, sizeof(fn_descr), (qsort_compar_t)fdescr_cmp);
+
+    /* uniq by .addr */
+    for (i = 1, ++p; i < nfns; i++, p++) {
+        if (p->addr != pw->addr) {
+            ++pw;
+            if (pw != p)
+                *pw = *p; /* names of aliases are freed with arena */
+        }
+    }
+
+    return pw+1 - fns;
+}
+
+/*
+ * Start addresses of module in Eytzinger (BFS) layout, 1-based:
+ * top levels of search share few cache lines, and probes don't touch
+ * names of fn_descr. eytz_idx maps slot to index in fns.
+ */
+static int
+fill_eytzinger(fn_module *mod, int i, int k)
+{
+    if (k <= mod->nfns) {
+        i = fill_eytzinger(mod, i, 2*k);
+        mod->eytz[k] = mod->fns[i].addr;
+        mod->eytz_idx[k] = i++;
+        i = fill_eytzinger(mod, i, 2*k + 1);
+    }
+    return i;
+}
+
+
+static void
+build_index(fn_module *mod)
+{
+    mod->eytz = (unsigned long *)malloc(sizeof(unsigned long) * (mod->nfns + 1));
+    mod->eytz_idx = (int *)malloc(sizeof(int) * (mod->nfns + 1));
+    if (!mod->eytz || !mod->eytz_idx)
+        err(1, "Failed to allocate index of %d functions", mod->nfns);
+
+    fill_eytzinger(mod, 0, 1);
+}
+
+
 static void
-add_fndescr(const char *name, unsigned long addr, unsigned len) {
-    static int fn_descr_size = 0;
-    fn_descr *descr;
+add_module(const struct maps_info *minf, bool is_exe)
+{
+    fn_module *mod;
 
-    if (g_nfndescr == fn_descr_size) {
-        fn_descr_size = (fn_descr_size == 0) ? 8096: fn_descr_size * 3 / 2;
-        g_fndescr = (fn_descr *)realloc(g_fndescr, 
-            fn_descr_size * sizeof(fn_descr) );
+    if (g_nmodules == modules_size) {
+        modules_size = (modules_size == 0) ? 64 : modules_size * 2;
+        g_modules = (fn_module *)realloc(g_modules, modules_size * sizeof(fn_module));
+        if (!g_modules)
+            err(1, "Failed to allocate %d modules", modules_size);
     }
 
-    descr = &g_fndescr[g_nfndescr++];
-    descr->name = strdup(cplus_demangle(name, AUTO_DEMANGLING) ?: name);
-    descr->addr = addr;
-    descr->len  = len;
+    mod = &g_modules[g_nmodules++];
+    memset(mod, 0, sizeof(fn_module));
+    mod->start = (unsigned long)minf->start_addr;
+    mod->end = (unsigned long)minf->end_addr;
+    mod->offset = minf->offset;
+    mod->path = strdup(minf->pathname);
+    if (!mod->path)
+        err(1, "Failed to allocate module %s", minf->pathname);
+    mod->is_exe = is_exe;
+    mod->special = (minf->pathname[0] != '/');
+    mod->loaded = mod->special; /* nothing to load */
 }
 
+
 static void
-finalize_fndescr() {
-    fn_descr *p  = g_fndescr,
-             *pw = g_fndescr;
-    int i;
+retire_module(const fn_module *mod)
+{
+    if (nretired == retired_size) {
+        retired_size = retired_size ? retired_size * 2 : 16;
+        retired = (fn_module *)realloc(retired, retired_size * sizeof(fn_module));
+        if (!retired)
+            err(1, "Failed to allocate %d modules", retired_size);
+    }
+    retired[nretired++] = *mod;
+}
 
-    qsort(p, g_nfndescr, sizeof(fn_descr), (qsort_compar_t)fdescr_cmp);
 
-    /* uniq by .addr */
-    for (i = 1, ++p; i < g_nfndescr; i++, p++) {
-        if (p->addr != pw->addr) {
-            ++pw;
-            if (pw != p) {
-                if (pw->name) free(pw->name); 
-                *pw = *p; p->name = 0;
+static int
+module_cmp(const fn_module *a, const fn_module *b)
+{
+    return (a->start == b->start) ? 0 : (a->start < b->start ? -1 : 1);
+}
+
+
+static bool
+same_mapping(const fn_module *mod, const struct maps_info *minf)
+{
+    return mod->start == (unsigned long)minf->start_addr &&
+           mod->end == (unsigned long)minf->end_addr &&
+           mod->offset == minf->offset && !strcmp(mod->path, minf->pathname);
+}
+
+
+/*
+ * Sync modules with executable mappings of process: new ones are added,
+ * gone (or replaced) ones retired. Loaded symbols of the rest are kept.
+ * Returns number of changes, -1 if maps can't be read.
+ */
+static int
+update_modules()
+{
+    struct maps_ctx *mctx;
+    struct maps_info *minf, **added = NULL;
+    char *alive;
+    int i, n, nadded = 0, nchanges = 0;
+
+    mctx = maps_fopen(traced_pid);
+    if (!mctx)
+        return -1;
+
+    alive = (char *)calloc(g_nmodules + 1, 1);
+    if (!alive)
+        err(1, "Failed to allocate %d modules", g_nmodules);
+
+    while ((minf = maps_readnext(mctx)) != NULL) {
+        fn_module *mod;
+
+        if (!(minf->prot & PROT_EXEC)) {
+            maps_free(minf);
+            continue;
+        }
+
+        mod = find_module((unsigned long)minf->start_addr);
+        if (mod && same_mapping(mod, minf)) {
+            alive[mod - g_modules] = 1;
+            maps_free(minf);
+            continue;
+        }
+
+        added = (struct maps_info **)realloc(added, sizeof(struct maps_info *) * (nadded + 1));
+        if (!added)
+            err(1, "Failed to allocate %d mappings", nadded + 1);
+        added[nadded++] = minf;
+    }
+    maps_close(mctx);
+
+    for (i = 0, n = 0; i < g_nmodules; i++) {
+        if (alive[i])
+            g_modules[n++] = g_modules[i];
+        else
+            retire_module(&g_modules[i]);
+    }
+    nchanges = g_nmodules - n;
+    g_nmodules = n;
+    free(alive);
+
+    for (i = 0; i < nadded; i++) {
+        add_module(added[i], !strcmp(added[i]->pathname, exe_path));
+        maps_free(added[i]);
+    }
+    free(added);
+    nchanges += nadded;
+
+    if (nchanges) {
+        qsort(g_modules, g_nmodules, sizeof(fn_module), (qsort_compar_t)module_cmp);
+        memset(ip_cache, 0, sizeof(ip_cache));
+    }
+
+    return nchanges;
+}
+
+
+static const fn_descr *
+lookup_jit(unsigned long ip)
+{
+    int l = 0, h = njit;
+
+    /* last function starting at or before ip */
+    while (l < h) {
+        int i = (l + h)/2;
+        if (jit_fns[i]->addr <= ip)
+            l = i + 1;
+        else
+            h = i;
+    }
+
+    if (l > 0 && ip < jit_fns[l-1]->addr + jit_fns[l-1]->len)
+        return jit_fns[l-1];
+    return NULL;
+}
+
+
+/* JIT function in order of definition, see update_jit() */
+typedef struct {
+    fn_descr *pfn;
+    int order;
+} jit_entry;
+
+static int
+jit_cmp(const jit_entry *a, const jit_entry *b)
+{
+    if (a->pfn->addr != b->pfn->addr)
+        return (a->pfn->addr < b->pfn->addr) ? -1 : 1;
+    return a->order - b->order;
+}
+
+
+/* code is redefined, but calltrees may refer old function */
+static void
+drop_jit(fn_descr *pfn)
+{
+    if (njit_dropped == jit_dropped_size) {
+        jit_dropped_size = jit_dropped_size ? jit_dropped_size * 2 : 1024;
+        jit_dropped = (fn_descr **)realloc(jit_dropped, sizeof(fn_descr *) * jit_dropped_size);
+        if (!jit_dropped)
+            err(1, "Failed to allocate %d JIT functions", jit_dropped_size);
+    }
+    jit_dropped[njit_dropped++] = pfn;
+}
+
+
+/* read lines appended to perf map: "START SIZE name", hex numbers */
+static int
+update_jit()
+{
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    int i, n, nread = 0;
+    FILE *f;
+
+    f = fopen(jit_path, "r");
+    if (!f)
+        return 0;
+    if (fseek(f, jit_pos, SEEK_SET) != 0) {
+        fclose(f);
+        return 0;
+    }
+
+    while ((len = getline(&line, &line_size, f)) > 0 && line[len - 1] == '\n') {
+        unsigned long start, size;
+        int name_pos = 0;
+        const fn_descr *old;
+
+        jit_pos += len;
+        line[len - 1] = '\0';
+        if (sscanf(line, "%lx %lx %n", &start, &size, &name_pos) < 2 || !name_pos)
+            continue;
+
+        if (njit + nread == jit_size) {
+            jit_size = jit_size ? jit_size * 2 : 1024;
+            jit_fns = (fn_descr **)realloc(jit_fns, sizeof(fn_descr *) * jit_size);
+            if (!jit_fns)
+                err(1, "Failed to allocate %d JIT functions", jit_size);
+        }
+
+        /* same definition again (map is rewritten): keep descriptor */
+        old = lookup_jit(start);
+        if (old && old->addr == start && old->len == size && !strcmp(old->name, line + name_pos))
+            continue;
+
+        /* index is sorted up to njit: new ones are merged below */
+        jit_fns[njit + nread++] = new_fn_descr(line + name_pos, start, size);
+    }
+    free(line);
+    fclose(f);
+
+    if (nread) {
+        /* old ones are first, new ones follow in order of map */
+        jit_entry *sorted;
+
+        njit += nread;
+        sorted = (jit_entry *)malloc(sizeof(jit_entry) * njit);
+        if (!sorted)
+            err(1, "Failed to allocate %d JIT functions", njit);
+        for (i = 0; i < njit; i++) {
+            sorted[i].pfn = jit_fns[i];
+            sorted[i].order = i;
+        }
+
+        /* new ones are mostly after old ones: qsort is fine anyway */
+        qsort(sorted, njit, sizeof(jit_entry), (qsort_compar_t)jit_cmp);
+        for (i = 0, n = 0; i < njit; i++) {
+            jit_entry *last = n ? &sorted[n-1] : NULL;
+
+            /* code of overlapped older function is gone */
+            if (last && (sorted[i].pfn->addr == last->pfn->addr ||
+                         sorted[i].pfn->addr < last->pfn->addr + last->pfn->len))
+            {
+                if (sorted[i].order > last->order) {
+                    drop_jit(last->pfn);
+                    *last = sorted[i];
+                }
+                else
+                    drop_jit(sorted[i].pfn);
             }
+            else
+                sorted[n++] = sorted[i];
         }
+
+        for (i = 0; i < n; i++)
+            jit_fns[i] = sorted[i].pfn;
+        njit = n;
+        free(sorted);
+    }
+
+    return nread;
+}
+
+
+static uint64_t
+monotonic_usec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/* re-read maps and JIT map if not done recently, true if anything new */
+static bool
+refresh_modules()
+{
+    uint64_t now = monotonic_usec();
+    int nmods, njitted;
+
+    if (now - last_refresh < refresh_interval)
+        return false;
+    last_refresh = now;
+
+    nmods = update_modules();
+    njitted = update_jit();
+    if (nmods <= 0 && !njitted) {
+        refresh_interval = (refresh_interval * 2 < REFRESH_MAX_USEC) ? refresh_interval * 2 : REFRESH_MAX_USEC;
+        return false;
     }
-    for (i = pw - g_fndescr + 1; i < g_nfndescr; i++) {
-        if (g_fndescr[i].name)
-            free(g_fndescr[i].name);
+
+    if (nmods > 0) {
+        print_message("maps of process changed: %d module(s) mapped or unmapped", nmods);
+        srcinfo_refresh();
     }
+    if (njitted)
+        print_message("%d JIT function(s) read from %s", njitted, jit_path);
 
-    g_nfndescr = pw+1 - g_fndescr;
-    g_fndescr = (fn_descr *)realloc(g_fndescr, sizeof(fn_descr) * g_nfndescr);
+    refresh_interval = REFRESH_MIN_USEC;
+    return true;
 }
 
-void 
+
+void
 init_fndescr(pid_t pid)
 {
-    struct maps_ctx *mctx;
-    struct maps_info *minf;
-    char *exe;
-    int i;
-
-    exe = proc_get_exefilename(pid);
-    if (!exe)
+    traced_pid = pid;
+    exe_path = proc_get_exefilename(pid);
+    if (!exe_path)
         err(1, "Failed to get path of %d", pid);
 
     elfreader_init();
-    mctx = maps_fopen(pid);
-    if (!mctx)
+    if (update_modules() < 0)
         err(1, "Failed to open maps file of PID %d", (int)pid);
-    
-    while ((minf = maps_readnext(mctx)) != NULL) {
-        if ((minf->prot & PROT_EXEC) && minf->pathname[0] == '/') {
-            elf_reader_t *er;
 
-            if (!strcmp(minf->pathname, exe)) {
-                print_message("reading symbols from %s (exe)", minf->pathname);
-                /* [1] read text table */
-                er = elf_read_textf(minf->pathname);
+    snprintf(jit_path, sizeof(jit_path), "/tmp/perf-%d.map", (int)pid);
+    if (update_jit())
+        print_message("%d JIT function(s) read from %s", njit, jit_path);
 
-                if (!er)
-                    err(1, "Failed to read text data from %s", minf->pathname);
+    memset(ip_cache, 0, sizeof(ip_cache));
+    /* first miss re-reads maps at once: launched process maps libraries just now */
+    last_refresh = 0;
+    refresh_interval = REFRESH_MIN_USEC;
+}
 
-                for (i = 0; i < er->nsymbols; i++) {
-                    const elf_symbol_t *es = &er->symbols[i];
-                    if (es->symbol_class == 'T' || es->symbol_class == 'W')
-                        add_fndescr(es->symbol_name, es->symbol_value, es->symbol_size);
-                }
-                elfreader_close(er);
+
+void
+init_fndescr_offline()
+{
+    traced_pid = 0;
+}
+
+
+/* re-read maps now: after exec, or before process exits and they are gone */
+void
+sync_fndescr()
+{
+    char *exe = proc_get_exefilename(traced_pid);
+
+    if (exe) {
+        free(exe_path);
+        exe_path = exe;
+    }
+
+    last_refresh = 0;
+    (void)refresh_modules();
+}
+
+
+/*
+ * Functions of ELF file (not relocated), sorted: text table of
+ * executable or dynamic table of library
+ */
+static bool
+read_elf_symbols(fn_module *mod, fn_descr **psyms, int *pnsyms)
+{
+    elf_reader_t *er;
+    elf_symbol_t es;
+    fn_descr *syms;
+    int n = 0;
+
+    if (mod->is_exe) {
+        /* [1] read text table */
+        er = elf_read_textf(mod->path);
+        if (!er) {
+            warn("Failed to read text data from %s", mod->path);
+            return false;
+        }
+    }
+    else {
+        /* [2] read dynamic table */
+        er = elf_read_dynaf(mod->path);
+        if (!er) {
+            warn("Failed to read dynamic data from %s", mod->path);
+            return false;
+        }
+    }
+
+    syms = (fn_descr *)malloc(sizeof(fn_descr) * (er->nsymbols + 1));
+    if (!syms)
+        err(1, "Failed to allocate %d symbols", er->nsymbols);
+
+    /* names are mangled and point into mmapped ELF: keep it */
+    while (elf_read_next(er, &es)) {
+        if (es.symbol_class == 'T' || es.symbol_class == 'W') {
+            syms[n].name = (char *)es.symbol_name;
+            syms[n].addr = es.symbol_value;
+            syms[n].len  = es.symbol_size;
+            syms[n].id   = -1;
+            n++;
+        }
+    }
+    mod->elf = er;
+
+    *psyms = syms;
+    *pnsyms = uniq_fndescr(syms, n);
+    return true;
+}
+
+
+/*
+ * Read, relocate and index functions of mapping. Touches nothing but
+ * module itself, so modules may be read in parallel.
+ * Failure is not fatal: module stays empty.
+ */
+static void
+read_module(fn_module *mod)
+{
+    fn_descr *syms = NULL;
+    int i, n = 0, nsyms = 0;
+
+    mod->cached = symcache_load(mod->path, !mod->is_exe, &mod->symcache, &syms, &nsyms);
+    if (!mod->cached && read_elf_symbols(mod, &syms, &nsyms))
+        symcache_save(mod->path, !mod->is_exe, syms, nsyms);
+
+    /* symbols are sorted and uniq, so are selected ones */
+    if (mod->is_exe) {
+        for (i = 0; i < nsyms; i++) {
+            if (syms[i].addr >= mod->start && syms[i].addr < mod->end)
+                syms[n++] = syms[i];
+        }
+    }
+    else {
+        off_t load_offset = mod->offset;
+        off_t load_end = mod->offset + (mod->end - mod->start);
+
+        for (i = 0; i < nsyms; i++) {
+            if ((off_t)syms[i].addr >= load_offset && (off_t)syms[i].addr < load_end) {
+                syms[n] = syms[i];
+                syms[n++].addr = (off_t)syms[i].addr - load_offset + mod->start;
+            }
+        }
+    }
+
+    if (n == 0) {
+        free(syms);
+        syms = NULL;
+    }
+    mod->fns = syms;
+    mod->nfns = n;
+    build_index(mod);
+}
+
+
+/* module of function, unmapped ones too; NULL for JIT and named ones */
+const fn_module *
+fn_module_of(const fn_descr *pfn)
+{
+    int i;
+
+    for (i = 0; i < g_nmodules; i++) {
+        if (pfn >= g_modules[i].fns && pfn < g_modules[i].fns + g_modules[i].nfns)
+            return &g_modules[i];
+    }
+    for (i = 0; i < nretired; i++) {
+        if (pfn >= retired[i].fns && pfn < retired[i].fns + retired[i].nfns)
+            return &retired[i];
+    }
+
+    return NULL;
+}
+
+
+/* address in ELF file (as objdump shows it) of IP, reverse of read_module() */
+unsigned long
+module_elf_addr(const fn_module *mod, unsigned long ip)
+{
+    return mod->is_exe ? ip : ip - mod->start + mod->offset;
+}
+
+
+/* make module visible for lookups: assign ids of functions */
+static void
+publish_module(fn_module *mod)
+{
+    int i;
+
+    print_message("reading symbols from %s (%s%s)", mod->path,
+        mod->is_exe ? "exe" : "dynlib", mod->cached ? ", cached" : "");
+
+    for (i = 0; i < mod->nfns; i++)
+        mod->fns[i].id = alloc_fn_id();
+    mod->loaded = true;
+}
+
+
+void
+load_fndescr(fn_module *mod)
+{
+    if (!mod->loaded) {
+        read_module(mod);
+        publish_module(mod);
+    }
+}
+
+
+typedef struct {
+    fn_module **mods;
+    int nmods;
+    int next;  /* taken by workers atomically */
+} load_queue;
+
+static void *
+load_worker(void *arg)
+{
+    load_queue *q = (load_queue *)arg;
+    int i;
+
+    while ((i = __sync_fetch_and_add(&q->next, 1)) < q->nmods)
+        read_module(q->mods[i]);
+
+    return NULL;
+}
+
+
+/*
+ * Load symbols of several modules at once: ELF reading and demangling
+ * of different files are independent, so use several threads.
+ */
+void
+load_fndescr_many(fn_module **mods, int nmods)
+{
+    pthread_t threads[MAX_LOAD_THREADS];
+    load_queue q;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int i, n = 0, nthreads;
+
+    /* keep unloaded ones only */
+    for (i = 0; i < nmods; i++) {
+        if (!mods[i]->loaded)
+            mods[n++] = mods[i];
+    }
+    nmods = n;
+
+    q.mods = mods;
+    q.nmods = nmods;
+    q.next = 0;
+
+    nthreads = (ncpu > MAX_LOAD_THREADS) ? MAX_LOAD_THREADS : (int)ncpu;
+    if (nthreads > nmods)
+        nthreads = nmods;
+
+    /* current thread is a worker too */
+    for (n = 0; n < nthreads - 1; n++) {
+        if (pthread_create(&threads[n], NULL, load_worker, &q) != 0)
+            break;
+    }
+    load_worker(&q);
+    for (i = 0; i < n; i++)
+        pthread_join(threads[i], NULL);
+
+    for (i = 0; i < nmods; i++)
+        publish_module(mods[i]);
+}
+
+
+fn_module *
+find_module(unsigned long ip)
+{
+    int l = 0, h = g_nmodules;
+
+    while(l < h) {
+        int i = (l + h)/2;
+        if (ip < g_modules[i].start)
+            h = i;
+        else if (ip >= g_modules[i].end)
+            l = i + 1;
+        else
+            return &g_modules[i];
+    }
+
+    return NULL;
+}
+
+
+const fn_descr *
+lookup_fn_descr(unsigned long ip)
+{
+    struct ip_cache_entry *ce = &ip_cache[((ip >> 4) ^ (ip >> 16)) & (IP_CACHE_SIZE - 1)];
+    const fn_descr *pfn = NULL;
+    fn_module *mod;
+    int k = 1, i;
+
+    if (ce->ip == ip)
+        return ce->pfn;
+
+    mod = find_module(ip);
+    if (!mod || mod->special) {
+        /* JIT code or library dlopen'ed since maps were read */
+        pfn = lookup_jit(ip);
+        if (pfn || !refresh_modules())
+            return pfn; /* not cached: maps may change */
+
+        mod = find_module(ip);
+        if (!mod || mod->special)
+            return lookup_jit(ip);
+    }
+
+    if (!mod->loaded)
+        load_fndescr(mod);
+
+    /* find first start address > ip: function before it may contain ip */
+    while (k <= mod->nfns) {
+        __builtin_prefetch(&mod->eytz[k * 8]); /* 8 descendants 3 levels below */
+        k = 2*k + (mod->eytz[k] <= ip);
+    }
+    k >>= __builtin_ffs(~k);
+
+    i = k ? mod->eytz_idx[k] - 1 : mod->nfns - 1;
+    if (i >= 0 && ip < mod->fns[i].addr + mod->fns[i].len)
+        pfn = &mod->fns[i];
+
+    ce->ip = ip;
+    ce->pfn = pfn;
+    return pfn;
+}
+
+
+/*
+ * Pseudo-function for IP without symbol: one per mapping, so time
+ * of stripped libraries, vdso etc is still accounted.
+ */
+const fn_descr *
+unknown_fn_descr(unsigned long ip)
+{
+    fn_module *mod = find_module(ip);
+    char name[PATH_MAX + 32];
+
+    if (!mod) {
+        if (!unmapped_fn)
+            unmapped_fn = fn_named("[unknown]");
+        return unmapped_fn;
+    }
+
+    if (!mod->unknown) {
+        const char *base = strrchr(mod->path, '/');
+
+        if (mod->special)
+            snprintf(name, sizeof(name), "%s", mod->path[0] ? mod->path : "[anonymous code]");
+        else
+            snprintf(name, sizeof(name), "[unknown in %s]", base ? base + 1 : mod->path);
+        mod->unknown = fn_named(name);
+    }
+    return mod->unknown;
+}
+
+
+/*
+ * Human-readable name of function. Symbols are kept mangled: most of them
+ * are never shown, and demangling of all is expensive.
+ */
+const char *
+fn_name(const fn_descr *pfn)
+{
+    if (pfn->id >= demangled_size) {
+        int old_size = demangled_size;
+
+        demangled_size = (g_nfndescr > pfn->id) ? g_nfndescr : pfn->id + 1;
+        demangled = (char **)realloc(demangled, sizeof(char *) * demangled_size);
+        if (!demangled)
+            err(1, "Failed to allocate %d names", demangled_size);
+        memset(demangled + old_size, 0, sizeof(char *) * (demangled_size - old_size));
+    }
+
+    if (!demangled[pfn->id]) {
+        /* own copy: freed with id, see release_fn_id() */
+        demangled[pfn->id] = cplus_demangle(pfn->name, AUTO_DEMANGLING);
+        if (!demangled[pfn->id])
+            demangled[pfn->id] = strdup(pfn->name);
+        if (!demangled[pfn->id])
+            err(1, "Failed to allocate name of %s", pfn->name);
+    }
+
+    return demangled[pfn->id];
+}
+
+
+static unsigned
+name_hash(const char *name)
+{
+    unsigned h = 2166136261u;
+
+    while (*name)
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+    return h;
+}
+
+
+static void
+named_insert(fn_descr *pfn)
+{
+    unsigned mask = named_size - 1,
+             h = name_hash(pfn->name) & mask;
+
+    while (named[h])
+        h = (h + 1) & mask;
+    named[h] = pfn;
+}
+
+
+/*
+ * Function which is not in symbol tables (inlined one, for example).
+ * Same name gives same descriptor, it has no address.
+ */
+const fn_descr *
+fn_named(const char *name)
+{
+    fn_descr *pfn;
+    unsigned h;
+
+    if (named_size) {
+        for (h = name_hash(name) & (named_size - 1); named[h]; h = (h + 1) & (named_size - 1)) {
+            if (!strcmp(named[h]->name, name))
+                return named[h];
+        }
+    }
+
+    if ((nnamed + 1) * 2 > named_size) {
+        fn_descr **old = named;
+        int i, old_size = named_size;
+
+        named_size = named_size ? named_size * 2 : 256;
+        named = (fn_descr **)calloc(named_size, sizeof(fn_descr *));
+        if (!named)
+            err(1, "Failed to allocate %d named functions", named_size);
+        for (i = 0; i < old_size; i++) {
+            if (old[i])
+                named_insert(old[i]);
+        }
+        free(old);
+    }
+
+    pfn = new_fn_descr(name, 0, 0);
+    named_insert(pfn);
+    nnamed++;
+    return pfn;
+}
+
+
+static void
+free_module(fn_module *mod)
+{
+    free(mod->path);
+    free(mod->fns);
+    free(mod->eytz);
+    free(mod->eytz_idx);
+    symcache_unmap(&mod->symcache);
+    elfreader_close((elf_reader_t *)mod->elf);
+}
+
+
+static bool
+module_used(const fn_module *mod, const char *used)
+{
+    int i;
+
+    for (i = 0; i < mod->nfns; i++) {
+        if (mod->fns[i].id >= 0 && used[mod->fns[i].id])
+            return true;
+    }
+    return false;
+}
+
+
+/*
+ * Free functions which no calltree refers: retired modules, redefined JIT
+ * functions and named ones not marked in `used' (by id, marks are added).
+ * Their ids are given out again, so with calltrees bounded (--window)
+ * neither memory nor g_nfndescr grows with uptime.
+ */
+void
+reclaim_fndescr(char *used)
+{
+    fn_descr **old = named;
+    int i, j, n, old_size = named_size;
+
+    /* modules refer their pseudo-functions themselves */
+    if (unmapped_fn)
+        used[unmapped_fn->id] = 1;
+    for (i = 0; i < g_nmodules; i++) {
+        if (g_modules[i].unknown)
+            used[g_modules[i].unknown->id] = 1;
+    }
+
+    for (i = 0, n = 0; i < nretired; i++) {
+        fn_module *mod = &retired[i];
+
+        if (module_used(mod, used)) {
+            if (mod->unknown)
+                used[mod->unknown->id] = 1;
+            retired[n++] = *mod;
+            continue;
+        }
+
+        for (j = 0; j < mod->nfns; j++) {
+            if (mod->fns[j].id >= 0)
+                release_fn_id(mod->fns[j].id);
+        }
+        free_module(mod);
+    }
+    nretired = n;
+
+    for (i = 0, n = 0; i < njit_dropped; i++) {
+        if (used[jit_dropped[i]->id])
+            jit_dropped[n++] = jit_dropped[i];
+        else {
+            release_fn_id(jit_dropped[i]->id);
+            free(jit_dropped[i]);
+        }
+    }
+    njit_dropped = n;
+
+    if (named_size) {
+        named = (fn_descr **)calloc(named_size, sizeof(fn_descr *));
+        if (!named)
+            err(1, "Failed to allocate %d named functions", named_size);
+        for (i = 0, nnamed = 0; i < old_size; i++) {
+            if (!old[i])
+                continue;
+            if (used[old[i]->id]) {
+                named_insert(old[i]);
+                nnamed++;
             }
             else {
-                /* [2] read dynamic table */
-                off_t load_offset = minf->offset;
-                off_t load_end = minf->offset + ((char *)minf->end_addr - (char *)minf->start_addr);
-                er = elf_read_dynaf(minf->pathname);
-
-                print_message("reading symbols from %s (dynlib)", minf->pathname);
-
-                if (!er)
-                    err(1, "Failed to read dynamic data from %s", minf->pathname);
-
-                for (i = 0; i < er->nsymbols; i++) {
-                    const elf_symbol_t *es = &er->symbols[i];
-                    if ((es->symbol_class == 'T' || es->symbol_class == 'W') && 
-                        (off_t)es->symbol_value >= load_offset && (off_t)es->symbol_value < load_end) 
-                    {
-                        add_fndescr(es->symbol_name, 
-                            (off_t)es->symbol_value - load_offset + (unsigned long)(char *)minf->start_addr,
-                            es->symbol_size);
-                    }
-                }
-                elfreader_close(er);
+                release_fn_id(old[i]->id);
+                free(old[i]);
             }
         }
-        maps_free(minf);
+        free(old);
     }
-    free(exe);
-    maps_close(mctx);
 
-    finalize_fndescr();
+    /* cached descriptors may be freed ones */
+    memset(ip_cache, 0, sizeof(ip_cache));
+    srcinfo_reclaim(used);
 }
 
 
@@ -140,13 +1016,47 @@ free_fndescr()
 {
     int i;
 
-    if (g_fndescr) {
-        for (i = 0; i < g_nfndescr; i++) {
-            free(g_fndescr[i].name);
-        }
+    for (i = 0; i < g_nmodules; i++)
+        free_module(&g_modules[i]);
+    for (i = 0; i < nretired; i++)
+        free_module(&retired[i]);
+    free(g_modules);
+    g_modules = NULL;
+    g_nmodules = modules_size = 0;
+    free(retired);
+    retired = NULL;
+    nretired = retired_size = 0;
+    for (i = 0; i < njit; i++)
+        free(jit_fns[i]);
+    free(jit_fns);
+    jit_fns = NULL;
+    njit = jit_size = 0;
+    jit_pos = 0;
+    for (i = 0; i < njit_dropped; i++)
+        free(jit_dropped[i]);
+    free(jit_dropped);
+    jit_dropped = NULL;
+    njit_dropped = jit_dropped_size = 0;
 
-        free(g_fndescr);
-        g_fndescr = NULL;
-        g_nfndescr = 0;
-    }
+    for (i = 0; i < demangled_size; i++)
+        free(demangled[i]);
+    free(demangled);
+    demangled = NULL;
+    demangled_size = 0;
+
+    for (i = 0; i < named_size; i++)
+        free(named[i]);
+    free(named);
+    named = NULL;
+    nnamed = named_size = 0;
+    unmapped_fn = NULL;
+
+    free(free_ids);
+    free_ids = NULL;
+    nfree_ids = free_ids_size = 0;
+    g_nfndescr = 0;
+
+    free(exe_path);
+    exe_path = NULL;
+    memset(ip_cache, 0, sizeof(ip_cache));
 }
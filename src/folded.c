@@ -0,0 +1,89 @@
+/*
+ * folded.c
+ * Calltree as folded stacks: "main;foo;bar 1234" per line, cost of
+ * last function by itself (nanoseconds). Format of flamegraph.pl.
+ */
+
+#define __STDC_FORMAT_MACROS
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <err.h>
+#include "crxprof.h"
+
+/* names of path from root, separated by ';' */
+typedef struct {
+    char *buf;
+    size_t len, size;
+} folded_path;
+
+
+static void
+path_push(folded_path *path, const char *name)
+{
+    size_t n = strlen(name) + 1, i;
+
+    if (path->len + n + 1 > path->size) {
+        path->size = (path->len + n + 1) * 2;
+        path->buf = (char *)realloc(path->buf, path->size);
+        if (!path->buf)
+            err(1, "Failed to allocate %zu bytes of stack", path->size);
+    }
+
+    if (path->len)
+        path->buf[path->len++] = ';';
+    for (i = 0; name[i]; i++)
+        path->buf[path->len++] = (name[i] == ';') ? ':' : name[i]; /* separator */
+    path->buf[path->len] = '\0';
+}
+
+
+/*
+ * Cost of node is its nself, or what is added since it was `seen' if any
+ * (then it is updated). Tree may be rebuilt since: node of other function
+ * or less cost means all is new.
+ */
+static void
+fold_node(const calltree_node *node, seen_cost *seen, folded_path *path, FILE *ofile)
+{
+    uint64_t cost = node->nself;
+    size_t len = path->len;
+    int i;
+
+    if (seen) {
+        seen_cost *s = &seen[node->seq];
+
+        if (s->pfn == node->pfn && s->nself <= cost)
+            cost -= s->nself;
+        s->pfn = node->pfn;
+        s->nself = node->nself;
+    }
+
+    path_push(path, fn_name(node->pfn));
+    if (cost)
+        fprintf(ofile, "%s %" PRIu64 "\n", path->buf, cost);
+
+    for (i = 0; i < node->nchilds; i++)
+        fold_node(&node->childs[i], seen, path, ofile);
+
+    path->len = len;
+    path->buf[len] = '\0';
+}
+
+
+/*
+ * Root is synthetic: not a part of stacks.
+ * `seen' (by seq, one per node of tree at least) may be NULL: whole cost.
+ */
+void
+dump_folded(const calltree_node *root, seen_cost *seen, FILE *ofile)
+{
+    folded_path path = { NULL, 0, 0 };
+    int i;
+
+    for (i = 0; i < root->nchilds; i++)
+        fold_node(&root->childs[i], seen, &path, ofile);
+
+    free(path.buf);
+}
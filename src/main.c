@@ -1,6 +1,7 @@
 /**
  * main.c
- * Entry point of crxprof. Parse arguments and collect symbols of given process (ID).
+ * Entry point of crxprof. Parse arguments and collect symbols of given process (ID)
+ * or of command launched by us.
  */
 
 #define __STDC_FORMAT_MACROS
@@ -15,6 +16,7 @@
 #include <sys/syscall.h>
 #include <sys/ptrace.h>
 #include <inttypes.h>
+#include <dirent.h>
 #include <signal.h>
 #include <errno.h>
 #include <assert.h>
@@ -23,6 +25,8 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <limits.h>
+#include <time.h>
 #include <sysexits.h>
 #include <getopt.h>
 #include <err.h>
@@ -35,6 +39,8 @@ static volatile bool sigint_caught = false;
 static volatile bool timer_alarmed = false;
 
 static char *g_progname;
+static int traced_status = 0; /* wait status of finished process */
+static bool leader_exiting = false; /* main thread exited before others, kept stopped */
 
 void
 on_sigint(int sig) {
@@ -53,26 +59,66 @@ on_sigchld(int sig) {
 
 
 #define FREQ_2PERIOD_USEC(n) ( 1000000 / (n) )
+#define PERF_DRAIN_PERIOD_USEC 20000 /* read perf buffers every 20ms */
+
+typedef enum { DUMP_CALLGRIND, DUMP_FOLDED, DUMP_SVG, DUMP_PPROF, DUMP_SNAPSHOT } dump_format_t;
 
 typedef struct 
 {
     unsigned us_sleep;
     int pid;
+    char **cmd;                /* command to launch, NULL - attach to pid */
     vproperties vprops;
     const char *dumpfile;
+    dump_format_t dump_format;
     crxprof_method prof_method;
+    bool use_perf;
+    bool defer_symbols;
+    bool use_symcache;
+    const char *symcache_dir;  /* NULL - default */
+    bool use_dwarf;
+    unwind_method_t unwind_method;
     bool just_print_symbols;
+    double duration;           /* stop after N seconds, 0 - no limit */
+    uint64_t max_samples;      /* stop after N snapshots, 0 - no limit */
+    unsigned window;           /* rotate profile every N seconds, 0 - never */
+    int nwindows;              /* windows kept in memory */
+    const char *socket_path;   /* serve profile over unix socket, NULL - don't */
+    const char *viewfile;      /* show snapshot instead of profiling, NULL - profile */
 } program_params;
 
 
 
-typedef enum { WR_NOTHING, WR_FINISHED, WR_NEED_DETACH, WR_STOPPED } waitres_t;
-static waitres_t do_wait(ptrace_context *ctx, bool blocked);
+typedef enum { WR_NOTHING, WR_FINISHED, WR_NEED_DETACH, WR_STOPPED, WR_THREAD_EXIT, WR_EXITING } waitres_t;
+
+/* process is gone or going to be left */
+static inline bool
+is_final(waitres_t wres)
+{
+    return wres == WR_FINISHED || wres == WR_NEED_DETACH || wres == WR_EXITING;
+}
+
+static waitres_t do_wait(ptrace_context *ctx, pid_t tid, bool blocked);
 static waitres_t discard_wait(ptrace_context *ctx);
+static void attach_process(ptrace_context *ctx);
+static pid_t launch_process(char **cmd);
+static void resume_launched(ptrace_context *ctx);
+static int detach_thread(ptrace_context *ctx, pid_t tid);
+static void detach_process(ptrace_context *ctx);
+static const char *limit_reached(const program_params *params, const ptrace_context *ctx,
+                                 const window_ring *ring, const struct timespec *started);
+static time_t rotate_window(const program_params *params, ptrace_context *ctx, calltree *tree,
+                            window_ring *ring, time_t start);
+static void show_windows(const program_params *params, const ptrace_context *ctx,
+                         const calltree *tree, const window_ring *ring);
+static waitres_t snap_thread(ptrace_context *ctx, thread_context *thr, calltree *tree);
 static void set_sigalrm();
 
-static void dump_profile(const ptrace_context *pctx, calltree_node *root, const char *filename);
+static void show_profile(const program_params *params, const ptrace_context *pctx, calltree_node *root);
+static void dump_profile(const program_params *params, const ptrace_context *pctx,
+                         calltree_node *root, const char *filename);
 static void print_symbols();
+static int view_snapshot(const program_params *params);
 static bool parse_args(program_params *params, int argc, char **argv);
 static long ptrace_verbose(enum __ptrace_request request, pid_t pid,
                    void *addr, intptr_t data);
@@ -82,153 +128,238 @@ static void usage();
 int
 main(int argc, char *argv[])
 {
-    int errc = 0;
     bool need_exit = false;
     ptrace_context ptrace_ctx;
     program_params params;
     struct itimerval itv;
-    struct proc_timer proc_time;
-    calltree_node *root = NULL;
+    struct timespec started;
+    window_ring ring;
+    time_t window_start;
+    calltree tree;
+    int i;
 
     g_progname = argv[0];
     if (!parse_args(&params, argc, argv))
         usage();
 
-    print_message("Reading symbols (list of function)");
+    if (params.viewfile)
+        return view_snapshot(&params);
+
+    if (params.use_symcache)
+        symcache_init(params.symcache_dir);
+
+    if (params.cmd) {
+        params.pid = launch_process(params.cmd);
+        print_message("Launched process: %d", params.pid);
+    }
+
+    print_message("Reading maps (symbols are read on demand)");
     init_fndescr(params.pid);
     if (params.just_print_symbols) {
         print_symbols();
         free_fndescr();
+        symcache_free();
         exit(0);
     }
 
+    if (params.use_dwarf) {
+        print_message("Reading DWARF info (inlined functions, source lines)");
+        if (!srcinfo_init(params.pid))
+            print_message("DWARF info is not available, using symbol tables only");
+    }
+
     if (params.prof_method == PROF_CPUTIME && has_openvz()) {
         print_message("If you inside OpenVZ container, there may be a problems with retrieving 'process CPU-time'");
         print_message("Profile process from OpenVZ-host (master) or use realtime profile instead (-r|--realtime)");
     }
 
-    if (!reset_process_time(&proc_time, params.pid, params.prof_method, &errc)) {
-        free_fndescr();
-        errx(2, "Failed to retrieve process time: %s", strerror(errc));
-    }
-
-
-    print_message("Attaching to process: %d", params.pid);
     memset(&ptrace_ctx, 0, sizeof(ptrace_ctx));
-    if (!trace_init(params.pid, &ptrace_ctx))
+    if (!trace_init(params.pid, params.prof_method, &ptrace_ctx))
         err(1, "Failed to initialize unwind internals");
+    ptrace_ctx.unwind_method = params.unwind_method;
+    ptrace_ctx.defer_symbols = params.defer_symbols;
+    ptrace_ctx.period_ns = (uint64_t)params.us_sleep * 1000;
+    calltree_track_instr(params.vprops.annotate_instr);
+    calltree_init(&tree);
+    window_ring_init(&ring, params.nwindows);
+
+    /* interval timer for snapshots (or reading perf buffers) */
+    itv.it_interval.tv_sec = 0;
+    itv.it_interval.tv_usec = params.us_sleep;
 
-    signal(SIGCHLD, on_sigchld);
-    if (ptrace(PTRACE_ATTACH, params.pid, 0, 0) == -1) {
-        int saved_errno = errno;
-        warn("ptrace(PTRACE_ATTACH) failed");
-        if (saved_errno == EPERM) {
-            printf("You have to see NOTES section of `man crxprof' for workarounds.\n");
+    if (params.use_perf) {
+        print_message("Opening perf events for process: %d", params.pid);
+        ptrace_ctx.use_perf = true;
+        ptrace_ctx.perf_freq = FREQ_2PERIOD_USEC(params.us_sleep);
+        if (!perf_attach(&ptrace_ctx))
+            err(1, "perf_event_open failed");
+        print_message("%d thread(s) sampled", ptrace_ctx.nthreads);
+        itv.it_interval.tv_usec = PERF_DRAIN_PERIOD_USEC;
+        if (params.cmd) {
+            signal(SIGCHLD, on_sigchld);
+            resume_launched(&ptrace_ctx);
         }
-        exit(2);
+    }
+    else if (params.cmd) {
+        signal(SIGCHLD, on_sigchld);
+        resume_launched(&ptrace_ctx);
+    }
+    else {
+        print_message("Attaching to process: %d", params.pid);
+        signal(SIGCHLD, on_sigchld);
+        attach_process(&ptrace_ctx);
+        print_message("%d thread(s) attached", ptrace_ctx.nthreads);
     }
 
-    if (do_wait(&ptrace_ctx, true) != WR_STOPPED)
-        err(1, "Error occured while stopping the process");
-
-    if (ptrace(PTRACE_CONT, params.pid, 0, 0) < 0)
-        err(1, "Error occured while stopping the process 2");
-
-
-    /* interval timer for snapshots */
-    itv.it_interval.tv_sec = 0;
-    itv.it_interval.tv_usec = params.us_sleep;
     itv.it_value = itv.it_interval;
-
     set_sigalrm();
     if (setitimer(ITIMER_REAL, &itv, NULL) == -1)
         err(1, "setitimer failed");
 
-    print_message("Starting profile (interval %dms)", params.us_sleep / 1000);
-    print_message("Press ENTER to show profile, ^C to quit");
-    signal(SIGINT, on_sigint);
+    print_message("Starting profile (interval %dms%s)", params.us_sleep / 1000,
+        params.use_perf ? ", perf_events" : "");
+    if (params.cmd) {
+        /* ^C is for command: its profile is shown when it exits */
+        signal(SIGINT, SIG_IGN);
+    }
+    else {
+        print_message("Press ENTER to show profile, ^C to quit");
+        signal(SIGINT, on_sigint);
+    }
+
+    if (params.duration > 0)
+        print_message("Profile is shown in %g seconds", params.duration);
+    if (params.max_samples)
+        print_message("Profile is shown after %" PRIu64 " snapshots", params.max_samples);
+    if (params.cmd && !params.duration && !params.max_samples)
+        print_message("Profile is shown when command exits");
+    if (params.window)
+        print_message("Profile is written out every %u seconds, last %d windows are kept",
+            params.window, params.nwindows);
+    if (params.socket_path) {
+        if (!stream_open(params.socket_path))
+            err(1, "Failed to listen on %s", params.socket_path);
+        print_message("Profile is served on %s (requests: full, delta ID)", params.socket_path);
+    }
 
     /* drop first meter since it contains our preparations */
-    (void)get_process_dt(&proc_time); 
+    for (i = 0; i < ptrace_ctx.nthreads; i++)
+        (void)get_process_dt(&ptrace_ctx.threads[i]->ptime);
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    window_start = time(NULL);
 
     while(!need_exit)
     {
         waitres_t wres = WR_NOTHING;
         bool key_pressed = false;
+        const char *limit = NULL;
 
-        wait4keypress(&key_pressed);
+        if (params.cmd)
+            pause(); /* stdin belongs to command */
+        else
+            wait4keypress(&key_pressed);
 
-        if (timer_alarmed) {
-            uint64_t proc_dt = get_process_dt(&proc_time);
-            bool need_prof = (params.prof_method == PROF_REALTIME);
-
-            if (params.prof_method == PROF_CPUTIME) {
-                char st = get_procstate(&ptrace_ctx);
-                if (st == 'R')
-                    need_prof = true;
+        if (timer_alarmed && params.use_perf) {
+            if (!perf_collect(&ptrace_ctx, &tree)) {
+                print_message("Traced process (%d) finished", params.pid);
+                wres = WR_FINISHED;
             }
-
-            if (need_prof) {
-                if (syscall(SYS_tkill, params.pid, SIGSTOP) == -1)
-                    warn("tkill(%d) failed", (int)params.pid);
-
-                wres = do_wait(&ptrace_ctx, true);
-                if (wres == WR_STOPPED) {
-                    int signo_cont = (ptrace_ctx.stop_signal == SIGSTOP) ? 0 : ptrace_ctx.stop_signal;
-
-                    if (!get_backtrace(&ptrace_ctx))
-                        err(2, "failed to get backtrace of process");
-
-                    /* continue tracee ASAP */
-                    if (ptrace_verbose(PTRACE_CONT, params.pid, 0, signo_cont) < 0)
-                        err(1, "ptrace(PTRACE_CONT) failed");
-
-                    ptrace_ctx.nsnaps++;
-                    if (fill_backtrace(proc_dt, &ptrace_ctx.stk, &root))
-                        ptrace_ctx.nsnaps_accounted++;
-                }
+            timer_alarmed = 0;
+        }
+        else if (timer_alarmed) {
+            /* thread list may change while snapping: re-check bounds every time */
+            for (i = 0; i < ptrace_ctx.nthreads; i++) {
+                if (ptrace_ctx.threads[i]->exited)
+                    continue;
+
+                wres = snap_thread(&ptrace_ctx, ptrace_ctx.threads[i], &tree);
+                if (is_final(wres))
+                    break;
             }
 
             timer_alarmed = 0;
         }
 
-        if (wres != WR_FINISHED && wres != WR_NEED_DETACH) {
+        /* launched command is traced in perf mode too: to stop at its exit */
+        if ((!params.use_perf || params.cmd) && !is_final(wres))
             wres = discard_wait(&ptrace_ctx);
+
+        if (!is_final(wres) && (limit = limit_reached(&params, &ptrace_ctx, &ring, &started)) != NULL) {
+            /* process goes on untraced while profile is being shown */
+            if (!params.use_perf)
+                detach_process(&ptrace_ctx);
+            else if (params.cmd)
+                (void)detach_thread(&ptrace_ctx, ptrace_ctx.pid);
+        }
+        else if (!is_final(wres) && params.window && time(NULL) - window_start >= (time_t)params.window)
+            window_start = rotate_window(&params, &ptrace_ctx, &tree, &ring, window_start);
+
+        if (!is_final(wres) && !limit)
+            stream_poll(&ptrace_ctx, &tree);
+
+        if (wres == WR_EXITING) {
+            /* maps are still there: read what is mapped since last lookup */
+            sync_fndescr();
+            if (params.use_perf)
+                (void)perf_collect(&ptrace_ctx, &tree);
         }
 
         if (sigint_caught) {
             print_message("Exit since ^C pressed");
             need_exit = true;
         }
-        else if (key_pressed || wres == WR_FINISHED || wres == WR_NEED_DETACH) {
-            if (root) {
-                print_message("%" PRIu64 " snapshot interrputs got (%" PRIu64 " dropped)", 
-                    ptrace_ctx.nsnaps, ptrace_ctx.nsnaps - ptrace_ctx.nsnaps_accounted);
-
-                visualize_profile(root, &params.vprops);
+        else if (key_pressed || limit || is_final(wres)) {
+            if (ptrace_ctx.defer_symbols)
+                stackrec_aggregate(&ptrace_ctx, &tree);
+
+            if (params.window)
+                show_windows(&params, &ptrace_ctx, &tree, &ring);
+            else if (tree.root) {
+                show_profile(&params, &ptrace_ctx, tree.root);
                 if (params.dumpfile)
-                    dump_profile(&ptrace_ctx, root, params.dumpfile);
+                    dump_profile(&params, &ptrace_ctx, tree.root, params.dumpfile);
             } else
                 print_message("No symbolic snapshot caught yet!");
         }
 
-        if (wres == WR_FINISHED || wres == WR_NEED_DETACH) {
+        if (is_final(wres)) {
             if (wres == WR_NEED_DETACH) {
-                (void)ptrace_verbose(PTRACE_DETACH, params.pid, 0, ptrace_ctx.stop_signal);
+                (void)ptrace_verbose(PTRACE_DETACH, ptrace_ctx.stop_tid, 0, ptrace_ctx.stop_signal);
                 print_message("Exit since program is stopped by (%d=%s)", ptrace_ctx.stop_signal, strsignal(ptrace_ctx.stop_signal));
             }
-            else
+            else {
+                if (wres == WR_EXITING) /* let it finish: other threads are released at our exit */
+                    (void)ptrace_verbose(PTRACE_DETACH, ptrace_ctx.pid, 0, 0);
+                if (leader_exiting) {
+                    /* last thread is stopped at exit too, the rest are gone */
+                    if (wres == WR_EXITING && ptrace_ctx.stop_tid != ptrace_ctx.pid)
+                        (void)ptrace(PTRACE_DETACH, ptrace_ctx.stop_tid, 0, 0);
+                    (void)waitpid(ptrace_ctx.pid, &traced_status, 0);
+                }
                 print_message("Exit since traced program is finished");
+            }
 
             need_exit = true;
         }
+        else if (limit) {
+            print_message("Exit since %s limit reached", limit);
+            need_exit = true;
+        }
     }
 
+    stream_close();
+    srcinfo_free();
     free_fndescr();
+    symcache_free();
     trace_free(&ptrace_ctx);
-    if (root)
-        calltree_destroy(root);
-
+    calltree_destroy(&tree);
+    window_ring_free(&ring);
+
+    /* exit code of launched command, as shell does */
+    if (params.cmd && WIFEXITED(traced_status))
+        return WEXITSTATUS(traced_status);
+    if (params.cmd && WIFSIGNALED(traced_status))
+        return 128 + WTERMSIG(traced_status);
     return 0;
 }
 
@@ -261,12 +392,407 @@ ptrace_verbose(enum __ptrace_request request, pid_t pid,
 }
 
 
+/* signal to pass on PTRACE_CONT: SIGSTOPs are ours (or attach-caused) */
+static inline int
+cont_signal(const ptrace_context *ctx)
+{
+    return (ctx->stop_signal == SIGSTOP) ? 0 : ctx->stop_signal;
+}
+
+
+/*
+ * Attach to every thread of the process.
+ * Threads may be created while we are attaching, so rescan
+ * /proc/pid/task until nothing new appears. Threads spawned later
+ * are attached by kernel (PTRACE_O_TRACECLONE) and reported by do_wait().
+ */
+static void
+attach_process(ptrace_context *ctx)
+{
+    char taskdir[sizeof("/proc/4000000000/task")];
+    bool attached_new;
+
+    sprintf(taskdir, "/proc/%d/task", ctx->pid);
+    do {
+        DIR *dir = opendir(taskdir);
+        struct dirent *de;
+
+        if (!dir)
+            err(1, "Failed to open %s", taskdir);
+
+        attached_new = false;
+        while ((de = readdir(dir)) != NULL) {
+            pid_t tid = atoi(de->d_name);
+            waitres_t wres;
+
+            if (tid <= 0 || trace_find_thread(ctx, tid))
+                continue;
+
+            if (ptrace(PTRACE_ATTACH, tid, 0, 0) == -1) {
+                int saved_errno = errno;
+
+                /* thread finished or already attached as clone of traced one */
+                if (tid != ctx->pid && (saved_errno == ESRCH || saved_errno == EPERM))
+                    continue;
+
+                warn("ptrace(PTRACE_ATTACH) failed");
+                if (saved_errno == EPERM) {
+                    printf("You have to see NOTES section of `man crxprof' for workarounds.\n");
+                }
+                exit(2);
+            }
+
+            if (!trace_add_thread(ctx, tid))
+                err(2, "Failed to setup thread %d", (int)tid);
+
+            wres = do_wait(ctx, tid, true);
+            if (wres == WR_THREAD_EXIT)
+                continue;
+            if (wres != WR_STOPPED)
+                err(1, "Error occured while stopping the process");
+
+            if (ptrace(PTRACE_SETOPTIONS, tid, 0, PTRACE_O_TRACECLONE) < 0)
+                err(1, "ptrace(PTRACE_SETOPTIONS) failed");
+
+            if (ptrace(PTRACE_CONT, tid, 0, cont_signal(ctx)) < 0)
+                err(1, "Error occured while stopping the process 2");
+
+            attached_new = true;
+        }
+        closedir(dir);
+    } while (attached_new);
+}
+
+
+/*
+ * Run command stopped right after exec: none of its code is executed yet.
+ * Only executable and dynamic loader are mapped by now, libraries are
+ * picked up as they are met (see lookup_fn_descr).
+ */
+static pid_t
+launch_process(char **cmd)
+{
+    pid_t pid;
+    int status;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == -1)
+        err(1, "fork failed");
+
+    if (pid == 0) {
+        if (ptrace(PTRACE_TRACEME, 0, 0, 0) == -1)
+            err(127, "ptrace(PTRACE_TRACEME) failed");
+        execvp(cmd[0], cmd);
+        err(127, "Failed to execute %s", cmd[0]);
+    }
+
+    if (waitpid(pid, &status, 0) == -1)
+        err(1, "waitpid failed");
+    if (WIFEXITED(status))
+        exit(WEXITSTATUS(status)); /* exec failed, reported by child */
+    if (!WIFSTOPPED(status) || WSTOPSIG(status) != SIGTRAP)
+        errx(1, "Failed to launch %s", cmd[0]);
+
+    return pid;
+}
+
+
+/*
+ * Let launched process run, stopping at its exit to show profile while
+ * maps are still readable. In perf mode only main thread is traced.
+ */
+static void
+resume_launched(ptrace_context *ctx)
+{
+    int options = PTRACE_O_TRACEEXIT | PTRACE_O_TRACEEXEC;
+
+    if (!ctx->use_perf) {
+        options |= PTRACE_O_TRACECLONE;
+        if (!trace_add_thread(ctx, ctx->pid))
+            err(2, "Failed to setup thread %d", (int)ctx->pid);
+    }
+
+    if (ptrace(PTRACE_SETOPTIONS, ctx->pid, 0, options) < 0)
+        err(1, "ptrace(PTRACE_SETOPTIONS) failed");
+
+    /* SIGTRAP of exec is ours */
+    if (ptrace(PTRACE_CONT, ctx->pid, 0, 0) < 0)
+        err(1, "ptrace(PTRACE_CONT) failed");
+}
+
+
+/*
+ * Leave thread running as if it was never traced. It may stop by another
+ * signal before our SIGSTOP: such one is delivered and SIGSTOP awaited.
+ * Threads it clones meanwhile are detached too (they start traced).
+ * Returns number of threads detached, 0 if thread is gone.
+ */
+static int
+detach_thread(ptrace_context *ctx, pid_t tid)
+{
+    thread_context *thr = trace_find_thread(ctx, tid);
+    int ndetached = 0;
+
+    /* stopped at exit already, would never report SIGSTOP */
+    if (tid == ctx->pid && leader_exiting)
+        return ptrace(PTRACE_DETACH, tid, 0, 0) == 0;
+
+    /* new clone is stopped by SIGSTOP of its own: one more would stay pending */
+    if (!(thr && thr->just_cloned) && syscall(SYS_tkill, tid, SIGSTOP) == -1)
+        return 0;
+
+    for (;;) {
+        waitres_t wres = do_wait(ctx, tid, true);
+
+        if (wres == WR_NEED_DETACH) {
+            /* stopped by terminal: SIGSTOP pending keeps it so anyway */
+            return ndetached + (ptrace(PTRACE_DETACH, tid, 0, ctx->stop_signal) == 0);
+        }
+        if (wres != WR_STOPPED && wres != WR_EXITING)
+            return ndetached;
+        if (wres == WR_EXITING || ctx->stop_signal == SIGSTOP)
+            break;
+
+        if (ctx->stop_event == PTRACE_EVENT_CLONE) {
+            unsigned long child;
+            thread_context *cthr;
+
+            /* registered by do_wait: untraced at once, so skipped by detach_process */
+            if (ptrace(PTRACE_GETEVENTMSG, tid, 0, &child) == 0 &&
+                (cthr = trace_find_thread(ctx, (pid_t)child)) != NULL && cthr->just_cloned)
+            {
+                ndetached += detach_thread(ctx, (pid_t)child);
+                if ((cthr = trace_find_thread(ctx, (pid_t)child)) != NULL && !cthr->exited)
+                    trace_thread_exited(ctx, cthr);
+            }
+        }
+
+        if (ptrace_verbose(PTRACE_CONT, tid, 0, ctx->stop_signal) < 0)
+            return ndetached;
+    }
+
+    return ndetached + (ptrace(PTRACE_DETACH, tid, 0, 0) == 0);
+}
+
+
+static void
+detach_process(ptrace_context *ctx)
+{
+    int i, n = 0, status, ndetached = 0;
+    pid_t *tids, tid;
+
+    /* threads exiting meanwhile are removed from ctx->threads: take tids first */
+    tids = (pid_t *)malloc(sizeof(pid_t) * (ctx->nthreads + 1));
+    if (!tids)
+        err(1, "Failed to allocate %d threads", ctx->nthreads);
+    for (i = 0; i < ctx->nthreads; i++) {
+        if (!ctx->threads[i]->exited)
+            tids[n++] = ctx->threads[i]->tid;
+    }
+
+    for (i = 0; i < n; i++) {
+        /* gone, or detached as a clone of another one */
+        if (trace_find_thread(ctx, tids[i]))
+            ndetached += detach_thread(ctx, tids[i]);
+    }
+    free(tids);
+    if (leader_exiting)
+        ndetached += detach_thread(ctx, ctx->pid);
+
+    /* unknown threads stopped meanwhile (cloned while attaching) */
+    while ((tid = waitpid(-1, &status, __WALL | WNOHANG)) > 0) {
+        if (WIFSTOPPED(status) && ptrace(PTRACE_DETACH, tid, 0, 0) == 0)
+            ndetached++;
+    }
+
+    print_message("Detached from %d thread(s) of process %d", ndetached, ctx->pid);
+}
+
+
+/* name of limit (--duration, --samples) reached, NULL if none */
+static const char *
+limit_reached(const program_params *params, const ptrace_context *ctx,
+              const window_ring *ring, const struct timespec *started)
+{
+    struct timespec now;
+
+    if (params->max_samples && ring->nsnaps_closed + ctx->nsnaps >= params->max_samples)
+        return "--samples";
+
+    if (params->duration > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - started->tv_sec) + (now.tv_nsec - started->tv_nsec) / 1e9 >= params->duration)
+            return "--duration";
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Close current window: write it out (dump or text), keep it packed in
+ * ring and start the next one from scratch. Returns start of next window.
+ */
+static time_t
+rotate_window(const program_params *params, ptrace_context *ctx, calltree *tree,
+              window_ring *ring, time_t start)
+{
+    char stamp[sizeof("20130202-235959")], path[PATH_MAX];
+    time_t now = time(NULL);
+    struct tm tm;
+
+    if (ctx->defer_symbols)
+        stackrec_aggregate(ctx, tree);
+
+    localtime_r(&start, &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+
+    if (!tree->root)
+        print_message("Window %s: no symbolic snapshot caught", stamp);
+    else if (params->dumpfile) {
+        snprintf(path, sizeof(path), "%s.%s", params->dumpfile, stamp);
+        dump_profile(params, ctx, tree->root, path);
+    }
+    else {
+        print_message("Window %s (%d seconds):", stamp, (int)(now - start));
+        show_profile(params, ctx, tree->root);
+    }
+
+    window_push(ring, ctx, tree, start, now);
+    trace_reset(ctx);
+    calltree_destroy(tree);
+    stream_reset();
+    window_reclaim(ring);
+    return now;
+}
+
+
+/* profile of windows kept and current one */
+static void
+show_windows(const program_params *params, const ptrace_context *ctx,
+             const calltree *tree, const window_ring *ring)
+{
+    ptrace_context view = *ctx;
+    packed_node *nodes;
+    calltree recent;
+    int nnodes;
+
+    calltree_init(&recent);
+    window_merge(ring, &view, &recent);
+    nodes = calltree_pack(tree, &nnodes);
+    (void)calltree_unpack(&recent, nodes, nnodes);
+    free(nodes);
+
+    if (recent.root) {
+        print_message("Last %d window(s) and current one:", ring->count);
+        show_profile(params, &view, recent.root);
+        if (params->dumpfile)
+            dump_profile(params, &view, recent.root, params->dumpfile);
+    } else
+        print_message("No symbolic snapshot caught yet!");
+
+    calltree_destroy(&recent);
+}
+
+
+static waitres_t
+snap_thread(ptrace_context *ctx, thread_context *thr, calltree *tree)
+{
+    uint64_t dt = get_process_dt(&thr->ptime);
+    waitres_t wres;
+
+    if (ctx->prof_method == PROF_CPUTIME && get_procstate(thr) != 'R')
+        return WR_NOTHING;
+
+    if (syscall(SYS_tkill, thr->tid, SIGSTOP) == -1) {
+        if (errno != ESRCH) /* exit of thread not reaped yet */
+            warn("tkill(%d) failed", (int)thr->tid);
+        return WR_NOTHING;
+    }
+
+    wres = do_wait(ctx, thr->tid, true);
+    if (wres == WR_STOPPED) {
+        if (!get_backtrace(ctx, thr))
+            err(2, "failed to get backtrace of thread %d", (int)thr->tid);
+
+        /* continue tracee ASAP */
+        if (ptrace_verbose(PTRACE_CONT, thr->tid, 0, cont_signal(ctx)) < 0)
+            err(1, "ptrace(PTRACE_CONT) failed");
+
+        account_backtrace(ctx, thr, thr->tid, dt, tree);
+    }
+
+    return wres;
+}
+
+
+/*
+ * Threads other than main one (and `except') still running. In perf mode
+ * only main thread is traced: threads of process are listed instead.
+ */
+static bool
+other_threads_alive(const ptrace_context *ctx, pid_t except)
+{
+    char taskdir[sizeof("/proc/4000000000/task")];
+    struct dirent *de;
+    DIR *dir;
+    bool alive = false;
+    int i;
+
+    if (!ctx->use_perf) {
+        for (i = 0; i < ctx->nthreads; i++) {
+            pid_t tid = ctx->threads[i]->tid;
+
+            if (!ctx->threads[i]->exited && tid != ctx->pid && tid != except)
+                return true;
+        }
+        return false;
+    }
+
+    sprintf(taskdir, "/proc/%d/task", ctx->pid);
+    if (!(dir = opendir(taskdir)))
+        return false;
+    while (!alive && (de = readdir(dir)) != NULL)
+        alive = atoi(de->d_name) > 0 && atoi(de->d_name) != ctx->pid && atoi(de->d_name) != except;
+    closedir(dir);
+    return alive;
+}
+
+
+/* it and main thread are kept stopped at exit: status is got after detach */
+static waitres_t
+last_thread_exited(const ptrace_context *ctx)
+{
+    print_message("Last thread of traced process (%d) exited", ctx->pid);
+    return WR_EXITING;
+}
+
+
+static void
+print_exiting(const ptrace_context *ctx)
+{
+    if (WIFSIGNALED(traced_status))
+        print_message("Traced process (%d) is terminated by signal %d (%s)", ctx->pid,
+            WTERMSIG(traced_status), strsignal(WTERMSIG(traced_status)));
+    else
+        print_message("Traced process (%d) is exiting with code %d", ctx->pid,
+            WEXITSTATUS(traced_status));
+}
+
+
+/*
+ * Wait for given thread (or any if tid == -1).
+ * Unknown stopped threads are clones of traced ones, so remember them.
+ */
 static waitres_t
-do_wait(ptrace_context *ctx, bool blocked)
+do_wait(ptrace_context *ctx, pid_t tid, bool blocked)
 {
     int status, ret;
+    thread_context *thr;
+
     do {
-        ret = waitpid(ctx->pid, &status, blocked ? 0 : WNOHANG);
+        ret = waitpid(tid, &status, __WALL | (blocked ? 0 : WNOHANG));
 
         if (ret == 0)
             return WR_NOTHING;
@@ -275,8 +801,23 @@ do_wait(ptrace_context *ctx, bool blocked)
             err(2, "waitpid failed");
     } while(ret < 0);
 
-    assert(ret == ctx->pid) ;
     assert(!WIFCONTINUED(status));
+    ctx->stop_tid = ret;
+    thr = trace_find_thread(ctx, ret);
+
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        if (ret != ctx->pid) {
+            if (thr)
+                trace_thread_exited(ctx, thr);
+
+            if (leader_exiting && !other_threads_alive(ctx, 0))
+                return last_thread_exited(ctx);
+            return WR_THREAD_EXIT;
+        }
+    }
+
+    if (ret == ctx->pid && (WIFEXITED(status) || WIFSIGNALED(status)))
+        traced_status = status;
 
     if (WIFEXITED(status)) {
         print_message("Traced process (%d) exited with code %d", ctx->pid, WEXITSTATUS(status));
@@ -289,6 +830,62 @@ do_wait(ptrace_context *ctx, bool blocked)
     }
 
     assert(WIFSTOPPED(status));
+    if (!thr && !(thr = trace_add_thread(ctx, ret)))
+        err(2, "Failed to setup thread %d", ret);
+    thr->just_cloned = false;
+
+    ctx->stop_event = status >> 16;
+    if (status >> 16) {
+        unsigned long msg;
+
+        /* PTRACE_EVENT_CLONE etc: nothing to reflect */
+        ctx->stop_signal = 0;
+
+        /* launched process is exiting (PTRACE_O_TRACEEXIT) */
+        if (ret == ctx->pid && (status >> 16) == PTRACE_EVENT_EXIT &&
+            ptrace(PTRACE_GETEVENTMSG, ret, 0, &msg) == 0)
+        {
+            traced_status = (int)msg;
+
+            /*
+             * Just main thread is gone (pthread_exit), or it is the first
+             * one of exit_group. Others are profiled until the last one
+             * exits; main thread is kept stopped so maps stay readable.
+             */
+            if (other_threads_alive(ctx, 0)) {
+                print_message("Main thread of traced process (%d) exited, other threads are running", ctx->pid);
+                leader_exiting = true;
+                if (!ctx->use_perf && (thr = trace_find_thread(ctx, ret)) != NULL)
+                    trace_thread_exited(ctx, thr);
+                return WR_THREAD_EXIT;
+            }
+
+            print_exiting(ctx);
+            return WR_EXITING;
+        }
+        /* the last thread: stays at exit with main one, so maps are readable */
+        if (ret != ctx->pid && leader_exiting && (status >> 16) == PTRACE_EVENT_EXIT &&
+            !other_threads_alive(ctx, ret))
+        {
+            return last_thread_exited(ctx);
+        }
+
+        /* new thread is known at once: its first stop may be reported much later */
+        if ((status >> 16) == PTRACE_EVENT_CLONE && ptrace(PTRACE_GETEVENTMSG, ret, 0, &msg) == 0 &&
+            !trace_find_thread(ctx, (pid_t)msg))
+        {
+            thread_context *child = trace_add_thread(ctx, (pid_t)msg);
+
+            /* NULL: its stop and exit are reported before this event */
+            if (child)
+                child->just_cloned = true;
+        }
+
+        if (ret == ctx->pid && (status >> 16) == PTRACE_EVENT_EXEC)
+            sync_fndescr(); /* command exec'ed another one */
+        return WR_STOPPED;
+    }
+
     ctx->stop_signal = WSTOPSIG(status);
 
     if (ctx->stop_signal == SIGTSTP || 
@@ -304,17 +901,24 @@ static waitres_t
 discard_wait(ptrace_context *ctx)
 {
     for(;;) {
-        waitres_t wres = do_wait(ctx, false);
+        waitres_t wres = do_wait(ctx, -1, false);
+
+        /* threads aren't traced by perf: they are just gone */
+        if (wres == WR_NOTHING && leader_exiting && ctx->use_perf && !other_threads_alive(ctx, 0))
+            return last_thread_exited(ctx);
 
         switch (wres) {
             case WR_NOTHING:
             case WR_FINISHED:
             case WR_NEED_DETACH:
+            case WR_EXITING:
                 return wres;
 
+            case WR_THREAD_EXIT:
+                break;
+
             case WR_STOPPED:
-                ptrace_verbose(PTRACE_CONT, ctx->pid, 0, 
-                    ctx->stop_signal == SIGSTOP ? 0 : ctx->stop_signal);
+                ptrace_verbose(PTRACE_CONT, ctx->stop_tid, 0, cont_signal(ctx));
                 break;
         }
     }
@@ -324,38 +928,78 @@ discard_wait(ptrace_context *ctx)
 static bool
 parse_args(program_params *params, int argc, char **argv)
 {
+    const char *last_optarg = NULL;
+
     params->us_sleep = FREQ_2PERIOD_USEC(DEFAULT_FREQ);
     params->dumpfile = NULL;
+    params->dump_format = DUMP_CALLGRIND;
     params->prof_method = PROF_CPUTIME;
+    params->use_perf = false;
+    params->defer_symbols = false;
+    params->use_symcache = true;
+    params->symcache_dir = NULL;
+    params->use_dwarf = false;
+    params->unwind_method = UNWIND_LIBUNWIND;
     params->just_print_symbols = false;
+    params->cmd = NULL;
+    params->duration = 0;
+    params->max_samples = 0;
+    params->window = 0;
+    params->nwindows = DEFAULT_NWINDOWS;
+    params->socket_path = NULL;
+    params->viewfile = NULL;
 
     params->vprops.max_depth = -1U;
     params->vprops.min_cost  = DEFAULT_MINCOST;
     params->vprops.print_fullstack = false;
+    params->vprops.per_thread = false;
+    params->vprops.annotate_instr = false;
 
 
     while(1) {
         int c;
-        enum { PRINT_FULL_STACK = 256, JUST_PRINT_SYMBOLS };
+        enum { PRINT_FULL_STACK = 256, JUST_PRINT_SYMBOLS, PER_THREAD, USE_PERF, UNWIND, DEFER_SYMBOLS,
+               SYMBOL_CACHE, NO_SYMBOL_CACHE, USE_DWARF, INSTR, DURATION, SAMPLES,
+               WINDOW, NWINDOWS, SOCKET, DUMP_FORMAT, VIEW };
 
         static struct option long_opts[] = {
             {"help",          no_argument,       0,  'h' },
             {"freq",          required_argument, 0,  'f' },
             {"full-stack",    no_argument,       0,   PRINT_FULL_STACK   },
+            {"per-thread",    no_argument,       0,   PER_THREAD         },
+            {"perf",          no_argument,       0,   USE_PERF           },
+            {"unwind",        required_argument, 0,   UNWIND             },
+            {"defer-symbols", no_argument,       0,   DEFER_SYMBOLS      },
+            {"symbol-cache",  required_argument, 0,   SYMBOL_CACHE       },
+            {"no-symbol-cache", no_argument,     0,   NO_SYMBOL_CACHE    },
+            {"dwarf",         no_argument,       0,   USE_DWARF          },
+            {"instr",         no_argument,       0,   INSTR              },
+            {"duration",      required_argument, 0,   DURATION           },
+            {"samples",       required_argument, 0,   SAMPLES            },
+            {"window",        required_argument, 0,   WINDOW             },
+            {"windows",       required_argument, 0,   NWINDOWS           },
+            {"socket",        required_argument, 0,   SOCKET             },
             {"print-symbols", no_argument,       0,   JUST_PRINT_SYMBOLS },
             {"max-depth",     required_argument, 0,  'm' },
             {"realtime",      no_argument,       0,  'r' },
             {"threshold",     required_argument, 0,  't' },
             {"dump",          required_argument, 0,  'd' },
+            {"dump-format",   required_argument, 0,   DUMP_FORMAT        },
+            {"view",          required_argument, 0,   VIEW               },
             {0,               0,                 0,   0  }
         };
 
         c = getopt_long(argc, argv, "m:rt:d:f:h", long_opts, NULL);
         if (c == -1) {
+            /* "--" ends options and starts command (unless it is an argument) */
+            if (optind > 1 && !strcmp(argv[optind - 1], "--") && argv[optind - 1] != last_optarg)
+                params->cmd = argv + optind;
+
             argc -= optind;
             argv += optind;
             break;
         }
+        last_optarg = optarg;
 
         switch(c) {
             case 't':
@@ -379,41 +1023,240 @@ parse_args(program_params *params, int argc, char **argv)
             case JUST_PRINT_SYMBOLS:
                 params->just_print_symbols = true;
                 break;
+            case PER_THREAD:
+                params->vprops.per_thread = true;
+                break;
+            case USE_PERF:
+                params->use_perf = true;
+                break;
+            case DEFER_SYMBOLS:
+                params->defer_symbols = true;
+                break;
+            case SYMBOL_CACHE:
+                params->symcache_dir = optarg;
+                break;
+            case NO_SYMBOL_CACHE:
+                params->use_symcache = false;
+                break;
+            case USE_DWARF:
+                params->use_dwarf = true;
+                break;
+            case INSTR:
+                params->vprops.annotate_instr = true;
+                break;
+            case DURATION:
+                params->duration = atof(optarg);
+                if (params->duration <= 0)
+                    usage();
+                break;
+            case SAMPLES:
+                params->max_samples = strtoull(optarg, NULL, 10);
+                if (!params->max_samples)
+                    usage();
+                break;
+            case WINDOW:
+                params->window = atoi(optarg) > 0 ? atoi(optarg) : 0;
+                if (!params->window)
+                    usage();
+                break;
+            case NWINDOWS:
+                params->nwindows = atoi(optarg);
+                if (params->nwindows <= 0)
+                    usage();
+                break;
+            case SOCKET:
+                params->socket_path = optarg;
+                break;
+            case DUMP_FORMAT:
+                if (!strcmp(optarg, "callgrind"))
+                    params->dump_format = DUMP_CALLGRIND;
+                else if (!strcmp(optarg, "folded"))
+                    params->dump_format = DUMP_FOLDED;
+                else if (!strcmp(optarg, "svg"))
+                    params->dump_format = DUMP_SVG;
+                else if (!strcmp(optarg, "pprof"))
+                    params->dump_format = DUMP_PPROF;
+                else if (!strcmp(optarg, "snapshot"))
+                    params->dump_format = DUMP_SNAPSHOT;
+                else
+                    usage();
+                break;
+            case VIEW:
+                params->viewfile = optarg;
+                break;
+            case UNWIND:
+                if (!strcmp(optarg, "fp"))
+                    params->unwind_method = UNWIND_FP;
+                else if (!strcmp(optarg, "libunwind"))
+                    params->unwind_method = UNWIND_LIBUNWIND;
+                else
+                    usage();
+                break;
             default:
                 usage();
         }
     }
 
-    if (argc != 1) {
+    if (params->viewfile) {
+        if (argc != 0 || params->cmd || params->just_print_symbols)
+            usage();
+        if (params->vprops.annotate_instr) {
+            warnx("hot instructions are not kept in snapshot, --instr can't be used with --view");
+            usage();
+        }
+        return true;
+    }
+
+    if (params->cmd ? argc < 1 : argc != 1) {
         usage();
     }
 
-    params->pid = atoi(argv[0]);
+    if (params->cmd && params->just_print_symbols) {
+        warnx("--print-symbols needs pid of running process");
+        usage();
+    }
+
+    if (params->use_perf && params->prof_method == PROF_REALTIME) {
+        warnx("realtime profile is not supported by --perf (only CPU-time is sampled)");
+        usage();
+    }
+
+    params->pid = params->cmd ? 0 : atoi(argv[0]);
     return true;
 }
 
 
+static void
+show_profile(const program_params *params, const ptrace_context *pctx, calltree_node *root)
+{
+    int i;
+
+    static const char *drop_reasons[NDROP_REASONS] = {
+        NULL, "empty or too deep backtraces", "lost by kernel"
+    };
+
+    print_message("%" PRIu64 " snapshot interrputs got (%" PRIu64 " dropped)", 
+        pctx->nsnaps, pctx->nsnaps - pctx->nsnaps_accounted);
+    for (i = DROP_NONE + 1; i < NDROP_REASONS; i++) {
+        if (pctx->ndropped[i])
+            print_message("    %" PRIu64 " dropped: %s", pctx->ndropped[i], drop_reasons[i]);
+    }
+    if (pctx->unwind_method == UNWIND_FP && pctx->nfp_fallbacks)
+        print_message("%" PRIu64 " broken frame-pointer chains unwound by libunwind", pctx->nfp_fallbacks);
+
+    if (params->vprops.per_thread) {
+        for (i = 0; i < pctx->nthreads; i++) {
+            const thread_context *thr = pctx->threads[i];
+            if (!thr->tree.root)
+                continue;
+
+            print_message("Thread %d%s: %" PRIu64 " snapshots (%" PRIu64 " dropped)", 
+                (int)thr->tid, thr->exited ? " (exited)" : "",
+                thr->nsnaps, thr->nsnaps - thr->nsnaps_accounted);
+            visualize_profile(thr->tree.root, &params->vprops);
+        }
+        print_message("All threads:");
+    }
+
+    visualize_profile(root, &params->vprops);
+
+    if (params->vprops.annotate_instr) {
+        print_message("Hot instructions (addresses as in `objdump -d'):");
+        annotate_instr(root, &params->vprops);
+    }
+}
+
+
 static void 
-dump_profile(const ptrace_context *pctx, calltree_node *root, const char *filename)
+dump_profile(const program_params *params, const ptrace_context *pctx,
+             calltree_node *root, const char *filename)
 {
+    static const char *format_names[] = { "Callgrind", "folded stacks", "SVG flame graph", "pprof",
+                                          "snapshot" };
     FILE *ofile;
 
     ofile = fopen(filename, "w");
     if (!ofile)
         err(1, "Failed to open file %s", filename);
 
-    dump_callgrind(pctx, root, ofile);
-    fclose(ofile);
-    print_message("Profile saved to %s (Callgrind format)", filename);
+    switch (params->dump_format) {
+        case DUMP_CALLGRIND:
+            dump_callgrind(pctx, root, ofile);
+            break;
+        case DUMP_FOLDED:
+            dump_folded(root, NULL, ofile);
+            break;
+        case DUMP_SVG:
+            dump_flamegraph(pctx, root, ofile);
+            break;
+        case DUMP_PPROF:
+            if (!dump_pprof(pctx, root, ofile))
+                err(1, "Failed to write file %s", filename);
+            break;
+        case DUMP_SNAPSHOT:
+            if (!dump_snapshot(pctx, root, ofile))
+                err(1, "Failed to write file %s", filename);
+            break;
+    }
+
+    if (fclose(ofile) != 0)
+        err(1, "Failed to write file %s", filename);
+    print_message("Profile saved to %s (%s format)", filename, format_names[params->dump_format]);
+}
+
+
+/* profile saved by --dump-format snapshot: shown (and dumped) as if just taken */
+static int
+view_snapshot(const program_params *params)
+{
+    ptrace_context ctx;
+    calltree tree;
+    char started[64];
+    struct tm tm;
+
+    init_fndescr_offline();
+    memset(&ctx, 0, sizeof(ctx));
+    calltree_init(&tree);
+    if (!snapshot_load(params->viewfile, &ctx, &tree))
+        exit(1);
+
+    localtime_r(&ctx.started, &tm);
+    strftime(started, sizeof(started), "%Y-%m-%d %H:%M:%S", &tm);
+    print_message("Snapshot of \"%s\" (profile started %s)", ctx.cmdline, started);
+
+    if (tree.root) {
+        show_profile(params, &ctx, tree.root);
+        if (params->dumpfile)
+            dump_profile(params, &ctx, tree.root, params->dumpfile);
+    } else
+        print_message("No symbolic snapshot caught yet!");
+
+    calltree_destroy(&tree);
+    snapshot_free(&ctx);
+    free_fndescr();
+    return 0;
 }
 
 
 static void
 print_symbols() {
-    int i;
-    for(i = 0; i < g_nfndescr; i++) {
-        printf("%p\t%d\t%s\n", (void *)g_fndescr[i].addr, 
-               g_fndescr[i].len, g_fndescr[i].name);
+    fn_module **mods = (fn_module **)malloc(sizeof(fn_module *) * (g_nmodules + 1));
+    int i, j;
+
+    if (!mods)
+        err(1, "Failed to allocate %d modules", g_nmodules);
+    for (i = 0; i < g_nmodules; i++)
+        mods[i] = &g_modules[i];
+    load_fndescr_many(mods, g_nmodules);
+    free(mods);
+
+    for (i = 0; i < g_nmodules; i++) {
+        fn_module *mod = &g_modules[i];
+
+        for(j = 0; j < mod->nfns; j++) {
+            printf("%p\t%d\t%s\n", (void *)mod->fns[j].addr,
+                   mod->fns[j].len, fn_name(&mod->fns[j]));
+        }
     }
 }
 
@@ -421,15 +1264,33 @@ static void
 usage()
 {
     fprintf(stderr, "Usage: %s [options] pid\n", g_progname);
+    fprintf(stderr, "       %s [options] -- command [args...]\n", g_progname);
+    fprintf(stderr, "       %s [options] --view FILE\n", g_progname);
     fprintf(stderr, "Options are:\n");
     fprintf(stderr, "\t-t|--threshold N:  visualize nodes that takes at least N%% of time (default: %.1f)\n", DEFAULT_MINCOST);
     fprintf(stderr, "\t-d|--dump FILE:    save callgrind dump to given FILE\n");
+    fprintf(stderr, "\t--dump-format FMT: format of dump: callgrind (default), folded, svg (flame graph),\n"
+                    "\t                   pprof or snapshot (binary, see --view)\n");
     fprintf(stderr, "\t-f|--freq FREQ:    set profile frequency to FREQ Hz (default: %d)\n", DEFAULT_FREQ);
     fprintf(stderr, "\t-m|--max-depth N:  show at most N levels while visualizing (default: no limit)\n");
     fprintf(stderr, "\t-r|--realtime:     use realtime profile instead of CPU\n");
     fprintf(stderr, "\t-h|--help:         show this help\n\n");
 
     fprintf(stderr, "\t--full-stack:      print full stack while visualizing (see manual)\n");
+    fprintf(stderr, "\t--per-thread:      visualize profile of every thread too\n");
+    fprintf(stderr, "\t--perf:            sample with perf_events, don't stop the process\n");
+    fprintf(stderr, "\t--unwind METHOD:   fp (frame pointers, libunwind if broken) or libunwind (default)\n");
+    fprintf(stderr, "\t--defer-symbols:   record raw stacks, resolve symbols only to show profile\n");
+    fprintf(stderr, "\t--symbol-cache DIR: keep parsed symbol tables in DIR (default: ~/.cache/crxprof)\n");
+    fprintf(stderr, "\t--no-symbol-cache: always read symbols from ELF files\n");
+    fprintf(stderr, "\t--dwarf:           show inlined functions and source lines (needs debug info)\n");
+    fprintf(stderr, "\t--instr:           show hot instructions, dump costs by instruction\n");
+    fprintf(stderr, "\t--duration SECS:   show (and dump) profile after SECS seconds, detach and quit\n");
+    fprintf(stderr, "\t--samples N:       show (and dump) profile after N snapshots, detach and quit\n");
+    fprintf(stderr, "\t--window SECS:     write profile out every SECS seconds (to FILE.TIME if -d) and reset it\n");
+    fprintf(stderr, "\t--windows N:       windows kept to show on ENTER and at exit (default: %d)\n", DEFAULT_NWINDOWS);
+    fprintf(stderr, "\t--socket PATH:     serve profile in folded format over unix socket PATH\n");
+    fprintf(stderr, "\t--view FILE:       show snapshot saved by --dump-format snapshot (-t, -m, -d apply)\n");
     fprintf(stderr, "\t--print-symbols:   just print funcs and addrs (and quit)\n\n");
     exit(EX_USAGE);
 }
@@ -0,0 +1,297 @@
+/*
+ * perf_events.c
+ *
+ * Sampling via perf_event_open(2): kernel takes user callchains of
+ * every thread on CPU-clock ticks and puts them into mmapped ring buffers.
+ * Traced process is never stopped.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <err.h>
+
+#include "crxprof.h"
+
+#if HAVE_LINUX_PERF_EVENT_H
+#include <linux/perf_event.h>
+
+#define PERF_DATA_PAGES  16 /* per thread, must be power of 2 */
+
+struct sample_record {
+    struct perf_event_header header;
+    uint32_t pid, tid;
+    uint64_t period;
+    uint64_t nr;
+    uint64_t ips[0];
+};
+
+struct lost_record {
+    struct perf_event_header header;
+    uint64_t id;
+    uint64_t lost;
+};
+
+static long
+sys_perf_event_open(struct perf_event_attr *attr, pid_t pid, int cpu,
+                    int group_fd, unsigned long flags)
+{
+    return syscall(__NR_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+
+/*
+ * Unprivileged users may be restricted to user-space events.
+ * Try to count time spent in kernel too: it will be accounted
+ * to user-space callchain (like ptrace-mode does for syscalls).
+ */
+bool
+perf_open_thread(const ptrace_context *ctx, thread_context *thr)
+{
+    struct perf_event_attr attr;
+    size_t mmap_size = (PERF_DATA_PAGES + 1) * sysconf(_SC_PAGESIZE);
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.config = PERF_COUNT_SW_TASK_CLOCK;
+    attr.freq = 1;
+    attr.sample_freq = ctx->perf_freq;
+    attr.sample_type = PERF_SAMPLE_TID | PERF_SAMPLE_PERIOD | PERF_SAMPLE_CALLCHAIN;
+    attr.sample_max_stack = MAX_STACK_DEPTH - 1; /* deeper ones are dropped anyway */
+    attr.exclude_callchain_kernel = 1;
+    attr.exclude_hv = 1;
+
+    fd = sys_perf_event_open(&attr, thr->tid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    if (fd == -1 && errno == EOVERFLOW) {
+        attr.sample_max_stack = 0; /* above kernel.perf_event_max_stack: use it */
+        fd = sys_perf_event_open(&attr, thr->tid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    }
+    if (fd == -1 && (errno == EACCES || errno == EPERM)) {
+        attr.exclude_kernel = 1;
+        fd = sys_perf_event_open(&attr, thr->tid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    }
+    if (fd == -1)
+        return false;
+
+    thr->perf_buf = mmap(NULL, mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (thr->perf_buf == MAP_FAILED) {
+        int saved_errno = errno;
+        thr->perf_buf = NULL;
+        close(fd);
+        errno = saved_errno;
+        return false;
+    }
+
+    thr->perf_fd = fd;
+    return true;
+}
+
+
+void
+perf_close_thread(thread_context *thr)
+{
+    if (thr->perf_buf) {
+        munmap(thr->perf_buf, (PERF_DATA_PAGES + 1) * sysconf(_SC_PAGESIZE));
+        thr->perf_buf = NULL;
+    }
+    if (thr->perf_fd != -1) {
+        close(thr->perf_fd);
+        thr->perf_fd = -1;
+    }
+}
+
+
+static void
+account_sample(ptrace_context *ctx, const struct sample_record *rec, calltree *tree)
+{
+    thread_context *thr = trace_find_thread(ctx, rec->tid);
+    trace_stack *pstk = &ctx->stk;
+    uint64_t i, nr = (rec->header.size - sizeof(*rec)) / sizeof(uint64_t);
+
+    if (rec->nr < nr)
+        nr = rec->nr;
+
+    pstk->depth = 0;
+    for (i = 0; i < nr && pstk->depth < MAX_STACK_DEPTH; i++) {
+        if (rec->ips[i] >= PERF_CONTEXT_MAX)
+            continue; /* context marker (PERF_CONTEXT_USER, ...) */
+        pstk->ips[pstk->depth++] = rec->ips[i];
+    }
+
+    account_backtrace(ctx, thr, rec->tid, rec->period, tree);
+}
+
+
+/* read all records available in ring buffer of given thread */
+static void
+drain_thread(ptrace_context *ctx, thread_context *thr, calltree *tree)
+{
+    static uint64_t recbuf[(sizeof(struct sample_record) / sizeof(uint64_t)) + MAX_STACK_DEPTH + 16];
+    struct perf_event_mmap_page *mp = (struct perf_event_mmap_page *)thr->perf_buf;
+    long pagesize = sysconf(_SC_PAGESIZE);
+    const char *data = (const char *)thr->perf_buf + pagesize;
+    uint64_t data_size = PERF_DATA_PAGES * pagesize;
+    uint64_t head, tail = mp->data_tail;
+
+    head = mp->data_head;
+    __sync_synchronize(); /* rmb() after reading data_head */
+
+    while (tail < head) {
+        uint64_t off = tail & (data_size - 1);
+        /* records are 8-byte aligned, so header itself is never wrapped */
+        const struct perf_event_header *hdr = (const struct perf_event_header *)&data[off];
+        size_t size = hdr->size;
+
+        if (size == 0)
+            break; /* broken buffer: shouldn't happen */
+
+        if (off + size > data_size) {
+            size_t part = data_size - off;
+            if (size > sizeof(recbuf)) {
+                tail += size;
+                continue;
+            }
+
+            memcpy(recbuf, &data[off], part);
+            memcpy((char *)recbuf + part, data, size - part);
+            hdr = (const struct perf_event_header *)recbuf;
+        }
+
+        switch (hdr->type) {
+            case PERF_RECORD_SAMPLE:
+                account_sample(ctx, (const struct sample_record *)hdr, tree);
+                break;
+            case PERF_RECORD_LOST:
+                ctx->nsnaps += ((const struct lost_record *)hdr)->lost;
+                ctx->ndropped[DROP_LOST] += ((const struct lost_record *)hdr)->lost;
+                break;
+        }
+
+        tail += size;
+    }
+
+    __sync_synchronize(); /* all data read before moving data_tail */
+    mp->data_tail = tail;
+}
+
+
+/*
+ * Open events for threads which are not sampled yet.
+ * Returns false if process has gone.
+ */
+static bool
+update_threads(ptrace_context *ctx)
+{
+    char taskdir[sizeof("/proc/4000000000/task")];
+    DIR *dir;
+    struct dirent *de;
+    thread_context *leader;
+    int i;
+
+    sprintf(taskdir, "/proc/%d/task", ctx->pid);
+    if (!(dir = opendir(taskdir)))
+        return false;
+
+    for (i = 0; i < ctx->nthreads; i++)
+        ctx->threads[i]->seen = false;
+
+    while ((de = readdir(dir)) != NULL) {
+        pid_t tid = atoi(de->d_name);
+        thread_context *thr;
+
+        if (tid <= 0)
+            continue;
+
+        if ((thr = trace_find_thread(ctx, tid)) == NULL) {
+            thr = trace_add_thread(ctx, tid);
+            if (!thr) {
+                if (errno == ESRCH)
+                    continue; /* gone already */
+                err(1, "Failed to open perf event for thread %d", (int)tid);
+            }
+        }
+        thr->seen = true;
+    }
+    closedir(dir);
+
+    for (i = 0; i < ctx->nthreads; i++) {
+        thread_context *thr = ctx->threads[i];
+        if (!thr->seen && !thr->exited) {
+            trace_thread_exited(ctx, thr);
+            i--; /* may be replaced by last one */
+        }
+    }
+
+    /* zombie leader without other threads: process is finished */
+    leader = trace_find_thread(ctx, ctx->pid);
+    for (i = 0; i < ctx->nthreads; i++) {
+        thread_context *thr = ctx->threads[i];
+        if (!thr->exited && (thr != leader || get_procstate(leader) != 'Z'))
+            return true;
+    }
+
+    return false;
+}
+
+
+bool
+perf_attach(ptrace_context *ctx)
+{
+    return update_threads(ctx);
+}
+
+
+bool
+perf_collect(ptrace_context *ctx, calltree *tree)
+{
+    int i;
+
+    for (i = 0; i < ctx->nthreads; i++) {
+        if (!ctx->threads[i]->exited)
+            drain_thread(ctx, ctx->threads[i], tree);
+    }
+
+    return update_threads(ctx);
+}
+
+#else /* HAVE_LINUX_PERF_EVENT_H */
+
+bool
+perf_open_thread(const ptrace_context *ctx, thread_context *thr)
+{
+    errno = ENOSYS;
+    return false;
+}
+
+void
+perf_close_thread(thread_context *thr)
+{
+}
+
+bool
+perf_attach(ptrace_context *ctx)
+{
+    errno = ENOSYS;
+    return false;
+}
+
+bool
+perf_collect(ptrace_context *ctx, calltree *tree)
+{
+    return false;
+}
+
+#endif /* HAVE_LINUX_PERF_EVENT_H */
@@ -0,0 +1,340 @@
+/*
+ * pprof.c
+ * Dump calltree as gzipped profile.proto of pprof
+ * (https://github.com/google/pprof/blob/main/proto/profile.proto).
+ *
+ * Written in one pass over tree: fields of Profile may go in any order,
+ * so every function (with its location and mapping) is written when met
+ * first, and strings are appended to string_table just before use.
+ * One location per function: call sites are kept only with --instr or
+ * --dwarf, and a function may be called from several of them.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <zlib.h>
+#include "crxprof.h"
+
+/* fields of messages */
+enum {
+    PROFILE_SAMPLE_TYPE = 1, PROFILE_SAMPLE = 2, PROFILE_MAPPING = 3, PROFILE_LOCATION = 4,
+    PROFILE_FUNCTION = 5, PROFILE_STRING_TABLE = 6, PROFILE_TIME_NANOS = 9,
+    PROFILE_DURATION_NANOS = 10, PROFILE_PERIOD_TYPE = 11, PROFILE_PERIOD = 12,
+    PROFILE_COMMENT = 13,
+    VALUETYPE_TYPE = 1, VALUETYPE_UNIT = 2,
+    SAMPLE_LOCATION_ID = 1, SAMPLE_VALUE = 2,
+    MAPPING_ID = 1, MAPPING_MEMORY_START = 2, MAPPING_MEMORY_LIMIT = 3, MAPPING_FILE_OFFSET = 4,
+    MAPPING_FILENAME = 5, MAPPING_HAS_FUNCTIONS = 7,
+    LOCATION_ID = 1, LOCATION_MAPPING_ID = 2, LOCATION_ADDRESS = 3, LOCATION_LINE = 4,
+    LINE_FUNCTION_ID = 1,
+    FUNCTION_ID = 1, FUNCTION_NAME = 2, FUNCTION_SYSTEM_NAME = 3, FUNCTION_FILENAME = 4
+};
+
+enum { WIRE_VARINT = 0, WIRE_BYTES = 2 };
+
+typedef struct {
+    gzFile gz;
+    bool failed;
+    size_t len;
+    unsigned char buf[65536];
+
+    int64_t nstrings;               /* written to string_table */
+    char *fn_written;               /* by fn_descr.id */
+    const fn_module **mappings;     /* written ones, id is index + 1 */
+    int nmappings;
+    uint64_t path[MAX_PACKED_DEPTH]; /* location ids from outermost */
+} pb_writer;
+
+
+static void
+pb_flush(pb_writer *w)
+{
+    if (w->len && gzwrite(w->gz, w->buf, w->len) != (int)w->len)
+        w->failed = true;
+    w->len = 0;
+}
+
+
+static void
+pb_bytes(pb_writer *w, const void *data, size_t size)
+{
+    const unsigned char *p = (const unsigned char *)data;
+
+    while (size) {
+        size_t n = sizeof(w->buf) - w->len;
+
+        if (n > size)
+            n = size;
+        memcpy(w->buf + w->len, p, n);
+        w->len += n;
+        p += n;
+        size -= n;
+        if (w->len == sizeof(w->buf))
+            pb_flush(w);
+    }
+}
+
+
+static void
+pb_varint(pb_writer *w, uint64_t v)
+{
+    unsigned char b[10];
+    int n = 0;
+
+    do {
+        b[n++] = (v & 0x7f) | (v > 0x7f ? 0x80 : 0);
+        v >>= 7;
+    } while (v);
+    pb_bytes(w, b, n);
+}
+
+
+static inline size_t
+varint_size(uint64_t v)
+{
+    size_t n = 1;
+
+    while (v > 0x7f) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+
+static inline void
+pb_key(pb_writer *w, int field, int wire)
+{
+    pb_varint(w, (uint64_t)field << 3 | wire);
+}
+
+
+/* zero is default value: not written */
+static void
+pb_uint(pb_writer *w, int field, uint64_t v)
+{
+    if (v) {
+        pb_key(w, field, WIRE_VARINT);
+        pb_varint(w, v);
+    }
+}
+
+
+static inline size_t
+uint_size(int field, uint64_t v)
+{
+    return v ? varint_size((uint64_t)field << 3) + varint_size(v) : 0;
+}
+
+
+/* header of embedded message (or packed field) of given size */
+static void
+pb_message(pb_writer *w, int field, size_t size)
+{
+    pb_key(w, field, WIRE_BYTES);
+    pb_varint(w, size);
+}
+
+
+static inline size_t
+message_size(int field, size_t size)
+{
+    return varint_size((uint64_t)field << 3) + varint_size(size) + size;
+}
+
+
+/* index of string appended to string_table */
+static int64_t
+pb_string(pb_writer *w, const char *s)
+{
+    size_t len = strlen(s);
+
+    pb_message(w, PROFILE_STRING_TABLE, len);
+    pb_bytes(w, s, len);
+    return w->nstrings++;
+}
+
+
+static void
+pb_value_type(pb_writer *w, int field, const char *type, const char *unit)
+{
+    int64_t itype = pb_string(w, type), iunit = pb_string(w, unit);
+
+    pb_message(w, field, uint_size(VALUETYPE_TYPE, itype) + uint_size(VALUETYPE_UNIT, iunit));
+    pb_uint(w, VALUETYPE_TYPE, itype);
+    pb_uint(w, VALUETYPE_UNIT, iunit);
+}
+
+
+/* id of mapping of module, written when met first */
+static uint64_t
+mapping_id(pb_writer *w, const fn_module *mod)
+{
+    int64_t ifile;
+    int i;
+
+    for (i = w->nmappings - 1; i >= 0; i--) {
+        if (w->mappings[i] == mod)
+            return i + 1;
+    }
+
+    w->mappings = (const fn_module **)realloc(w->mappings, sizeof(fn_module *) * (w->nmappings + 1));
+    if (!w->mappings) {
+        w->failed = true;
+        return 0;
+    }
+    w->mappings[w->nmappings++] = mod;
+
+    ifile = pb_string(w, mod->path);
+    pb_message(w, PROFILE_MAPPING,
+        uint_size(MAPPING_ID, w->nmappings) + uint_size(MAPPING_MEMORY_START, mod->start) +
+        uint_size(MAPPING_MEMORY_LIMIT, mod->end) + uint_size(MAPPING_FILE_OFFSET, mod->offset) +
+        uint_size(MAPPING_FILENAME, ifile) + uint_size(MAPPING_HAS_FUNCTIONS, 1));
+    pb_uint(w, MAPPING_ID, w->nmappings);
+    pb_uint(w, MAPPING_MEMORY_START, mod->start);
+    pb_uint(w, MAPPING_MEMORY_LIMIT, mod->end);
+    pb_uint(w, MAPPING_FILE_OFFSET, mod->offset);
+    pb_uint(w, MAPPING_FILENAME, ifile);
+    pb_uint(w, MAPPING_HAS_FUNCTIONS, 1);
+
+    return w->nmappings;
+}
+
+
+/* id of location (and function) of pfn, both written when met first */
+static uint64_t
+location_id(pb_writer *w, const fn_descr *pfn)
+{
+    const fn_module *mod;
+    const char *file;
+    uint64_t id = pfn->id + 1, mapping = 0, addr = 0;
+    int64_t iname, isystem, ifile = 0;
+    size_t line_size;
+
+    if (w->fn_written[pfn->id])
+        return id;
+    w->fn_written[pfn->id] = 1;
+
+    /* pseudo-functions (inlined, unknown code) have no mapping */
+    mod = fn_module_of(pfn);
+    if (mod && pfn->addr >= mod->start && pfn->addr < mod->end) {
+        mapping = mapping_id(w, mod);
+        addr = pfn->addr;
+    }
+
+    iname = pb_string(w, fn_name(pfn));
+    isystem = strcmp(pfn->name, fn_name(pfn)) ? pb_string(w, pfn->name) : iname;
+    if ((file = srcinfo_file(pfn)) != NULL)
+        ifile = pb_string(w, file);
+
+    pb_message(w, PROFILE_FUNCTION,
+        uint_size(FUNCTION_ID, id) + uint_size(FUNCTION_NAME, iname) +
+        uint_size(FUNCTION_SYSTEM_NAME, isystem) + uint_size(FUNCTION_FILENAME, ifile));
+    pb_uint(w, FUNCTION_ID, id);
+    pb_uint(w, FUNCTION_NAME, iname);
+    pb_uint(w, FUNCTION_SYSTEM_NAME, isystem);
+    pb_uint(w, FUNCTION_FILENAME, ifile);
+
+    line_size = uint_size(LINE_FUNCTION_ID, id);
+    pb_message(w, PROFILE_LOCATION,
+        uint_size(LOCATION_ID, id) + uint_size(LOCATION_MAPPING_ID, mapping) +
+        uint_size(LOCATION_ADDRESS, addr) + message_size(LOCATION_LINE, line_size));
+    pb_uint(w, LOCATION_ID, id);
+    pb_uint(w, LOCATION_MAPPING_ID, mapping);
+    pb_uint(w, LOCATION_ADDRESS, addr);
+    pb_message(w, LOCATION_LINE, line_size);
+    pb_uint(w, LINE_FUNCTION_ID, id);
+
+    return id;
+}
+
+
+/* stack of depth frames in w->path: locations go from leaf */
+static void
+pb_sample(pb_writer *w, int depth, uint64_t nsnaps, uint64_t cost)
+{
+    size_t ids_size = 0, values_size = varint_size(nsnaps) + varint_size(cost);
+    int i;
+
+    for (i = 0; i < depth; i++)
+        ids_size += varint_size(w->path[i]);
+
+    pb_message(w, PROFILE_SAMPLE,
+        message_size(SAMPLE_LOCATION_ID, ids_size) + message_size(SAMPLE_VALUE, values_size));
+    pb_message(w, SAMPLE_LOCATION_ID, ids_size);
+    for (i = depth - 1; i >= 0; i--)
+        pb_varint(w, w->path[i]);
+    pb_message(w, SAMPLE_VALUE, values_size);
+    pb_varint(w, nsnaps);
+    pb_varint(w, cost);
+}
+
+
+static void
+write_node(pb_writer *w, const calltree_node *node, int depth)
+{
+    int i;
+
+    w->path[depth] = location_id(w, node->pfn);
+    if (node->nself)
+        pb_sample(w, depth + 1, node->nsnaps, node->nself);
+
+    for (i = 0; i < node->nchilds && depth + 1 < MAX_PACKED_DEPTH; i++)
+        write_node(w, &node->childs[i], depth + 1);
+}
+
+
+/* root is synthetic: stacks start from its childs */
+bool
+dump_pprof(const ptrace_context *ctx, calltree_node *root, FILE *ofile)
+{
+    pb_writer *w;
+    time_t now = ctx->ended ? ctx->ended : time(NULL);
+    const char *type = (ctx->prof_method == PROF_REALTIME) ? "wall" : "cpu";
+    int64_t icomment;
+    int i, fd;
+    bool ok;
+
+    w = (pb_writer *)calloc(1, sizeof(pb_writer));
+    if (!w)
+        return false;
+    w->fn_written = (char *)calloc(g_nfndescr + 1, 1);
+
+    fflush(ofile);
+    fd = dup(fileno(ofile));
+    w->gz = (fd != -1) ? gzdopen(fd, "wb") : NULL;
+    if (!w->gz || !w->fn_written) {
+        if (fd != -1 && !w->gz)
+            close(fd);
+        free(w->fn_written);
+        free(w);
+        return false;
+    }
+
+    /* string_table[0] must be "" */
+    (void)pb_string(w, "");
+    pb_value_type(w, PROFILE_SAMPLE_TYPE, "samples", "count");
+    pb_value_type(w, PROFILE_SAMPLE_TYPE, type, "nanoseconds");
+    pb_value_type(w, PROFILE_PERIOD_TYPE, type, "nanoseconds");
+    pb_uint(w, PROFILE_PERIOD, ctx->period_ns);
+    pb_uint(w, PROFILE_TIME_NANOS, (uint64_t)ctx->started * 1000000000);
+    pb_uint(w, PROFILE_DURATION_NANOS, (uint64_t)(now - ctx->started) * 1000000000);
+
+    icomment = pb_string(w, ctx->cmdline ? ctx->cmdline : "");
+    pb_uint(w, PROFILE_COMMENT, icomment);
+
+    for (i = 0; i < root->nchilds; i++)
+        write_node(w, &root->childs[i], 0);
+
+    pb_flush(w);
+    ok = !w->failed;
+    if (gzclose(w->gz) != Z_OK)
+        ok = false;
+
+    free(w->mappings);
+    free(w->fn_written);
+    free(w);
+    return ok;
+}
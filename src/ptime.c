@@ -3,12 +3,35 @@
  * get process CPU time
  */
 #include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "ptime.h"
 
+/*
+ * Thread CPU-clocks of foreign processes are not available via
+ * clock_gettime(2), so use first field of schedstat (nanoseconds on CPU)
+ */
+static uint64_t
+get_schedstat_time(const struct proc_timer *pt) {
+    char buf[64];
+    ssize_t n = pread(pt->schedstat_fd, buf, sizeof(buf) - 1, 0);
+
+    if (n <= 0)
+        return -1;
+
+    buf[n] = '\0';
+    return strtoull(buf, NULL, 10);
+}
+
 static uint64_t
 get_process_time(const struct proc_timer *pt) {
     struct timespec ts;
 
+    if (pt->schedstat_fd != -1)
+        return get_schedstat_time(pt);
+
     return (clock_gettime(pt->clock_id, &ts) == -1) ?
         -1 :
         (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
@@ -17,6 +40,8 @@ get_process_time(const struct proc_timer *pt) {
 
 bool
 reset_process_time(struct proc_timer *pt, pid_t pid, crxprof_method method, int *error) {
+    pt->schedstat_fd = -1;
+
     switch(method) {
         case PROF_REALTIME:
             pt->clock_id = CLOCK_MONOTONIC;
@@ -37,6 +62,48 @@ reset_process_time(struct proc_timer *pt, pid_t pid, crxprof_method method, int
 }
 
 
+bool
+reset_thread_time(struct proc_timer *pt, pid_t pid, pid_t tid, crxprof_method method, int *error) {
+    char path[sizeof("/proc/4000000000/task/4000000000/schedstat")];
+
+    pt->schedstat_fd = -1;
+
+    switch(method) {
+        case PROF_REALTIME:
+            pt->clock_id = CLOCK_MONOTONIC;
+            break;
+        case PROF_CPUTIME:
+            sprintf(path, "/proc/%d/task/%d/schedstat", (int)pid, (int)tid);
+            if ((pt->schedstat_fd = open(path, O_RDONLY)) == -1) {
+                *error = errno;
+                return false;
+            }
+            break;
+        case PROF_IOWAIT:
+            return false; /* unsupported */
+            break;
+    }
+
+    pt->prev_time = get_process_time(pt);
+    *error = errno;
+    if (pt->prev_time == (uint64_t)-1) {
+        free_process_time(pt);
+        return false;
+    }
+
+    return true;
+}
+
+
+void
+free_process_time(struct proc_timer *pt) {
+    if (pt->schedstat_fd != -1) {
+        close(pt->schedstat_fd);
+        pt->schedstat_fd = -1;
+    }
+}
+
+
 uint64_t
 get_process_dt(struct proc_timer *pt) {
     uint64_t t = get_process_time(pt);
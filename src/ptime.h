@@ -13,10 +13,13 @@ struct proc_timer
 {
     uint64_t prev_time;
     clockid_t clock_id;
+    int schedstat_fd;    /* source of thread CPU-time (-1 if clock_id used) */
 };
 
 
 bool reset_process_time(struct proc_timer *pt, pid_t pid, crxprof_method method, int *error);
+bool reset_thread_time(struct proc_timer *pt, pid_t pid, pid_t tid, crxprof_method method, int *error);
+void free_process_time(struct proc_timer *pt);
 uint64_t get_process_dt(struct proc_timer *pt);
 
 #endif /* CRXPROF_PTIME_H_ */
@@ -0,0 +1,182 @@
+/*
+ * remote_mem.c
+ *
+ * libunwind accessors for stopped tracee. Same as _UPT_accessors, but
+ * memory is read by pages (process_vm_readv or /proc/pid/mem) and cached
+ * while tracee is stopped, instead of PTRACE_PEEKDATA for every word.
+ * Threads are unwound one by one, so all of them share one cache.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* process_vm_readv */
+#endif
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "crxprof.h"
+#include <libunwind-ptrace.h>
+
+#define RMEM_PAGE_SIZE  4096
+#define RMEM_NPAGES     32   /* direct-mapped cache, power of 2 */
+
+struct rmem_page {
+    unw_word_t addr;      /* address of cached page */
+    unsigned generation;  /* valid only if equal to cache_generation */
+    char data[RMEM_PAGE_SIZE];
+};
+
+typedef enum { RMEM_VM_READV, RMEM_PROCMEM, RMEM_PEEKDATA } rmem_method;
+
+typedef struct {
+    pid_t tid;
+    void *upt;            /* _UPT context: registers, unwind info */
+    rmem_method method;
+    int procmem_fd;
+} remote_mem;
+
+static remote_mem *rmem_current = NULL; /* thread being unwound */
+static struct rmem_page pages[RMEM_NPAGES]; /* of rmem_current */
+static unsigned cache_generation = 1;
+
+
+void *
+rmem_create(pid_t tid)
+{
+    remote_mem *rm = (remote_mem *)calloc(1, sizeof(remote_mem));
+    if (!rm)
+        return NULL;
+
+    rm->upt = _UPT_create(tid);
+    if (!rm->upt) {
+        free(rm);
+        return NULL;
+    }
+
+    rm->tid = tid;
+    rm->method = RMEM_VM_READV;
+    rm->procmem_fd = -1;
+    return rm;
+}
+
+
+void
+rmem_destroy(void *arg)
+{
+    remote_mem *rm = (remote_mem *)arg;
+
+    if (rmem_current == rm)
+        rmem_current = NULL;
+
+    _UPT_destroy(rm->upt);
+    if (rm->procmem_fd != -1)
+        close(rm->procmem_fd);
+    free(rm);
+}
+
+
+/*
+ * Start unwinding of given thread. Returns argument for unw_init_remote.
+ * Cached pages are of other thread or tracee was running since: drop them.
+ */
+void *
+rmem_begin(void *arg)
+{
+    remote_mem *rm = (remote_mem *)arg;
+
+    if (++cache_generation == 0)
+        cache_generation = 1; /* 0 marks invalid page */
+    rmem_current = rm;
+    return rm->upt;
+}
+
+
+static bool
+read_page(remote_mem *rm, unw_word_t addr, char *buf)
+{
+    struct iovec local = { buf, RMEM_PAGE_SIZE },
+                 remote = { (void *)(uintptr_t)addr, RMEM_PAGE_SIZE };
+
+    if (rm->method == RMEM_VM_READV) {
+        if (process_vm_readv(rm->tid, &local, 1, &remote, 1, 0) == RMEM_PAGE_SIZE)
+            return true;
+        if (errno != ENOSYS && errno != EPERM)
+            return false;
+        rm->method = RMEM_PROCMEM; /* old kernel or restricted */
+    }
+
+    if (rm->method == RMEM_PROCMEM) {
+        if (rm->procmem_fd == -1) {
+            char path[sizeof("/proc/4000000000/mem")];
+            sprintf(path, "/proc/%d/mem", (int)rm->tid);
+            rm->procmem_fd = open(path, O_RDONLY);
+        }
+        if (rm->procmem_fd != -1)
+            return pread(rm->procmem_fd, buf, RMEM_PAGE_SIZE, (off_t)addr) == RMEM_PAGE_SIZE;
+        rm->method = RMEM_PEEKDATA;
+    }
+
+    return false;
+}
+
+
+static int
+rmem_access_mem(unw_addr_space_t as, unw_word_t addr, unw_word_t *val, int write, void *arg)
+{
+    remote_mem *rm = rmem_current;
+    unw_word_t page_addr = addr & ~(unw_word_t)(RMEM_PAGE_SIZE - 1);
+    struct rmem_page *page;
+
+    if (!rm || rm->upt != arg)
+        return _UPT_access_mem(as, addr, val, write, arg);
+
+    if (write) {
+        rmem_begin(rm);
+        return _UPT_access_mem(as, addr, val, write, rm->upt);
+    }
+
+    /* word crossing pages is unusual: don't bother */
+    if (rm->method == RMEM_PEEKDATA || addr - page_addr + sizeof(*val) > RMEM_PAGE_SIZE)
+        return _UPT_access_mem(as, addr, val, write, rm->upt);
+
+    page = &pages[(page_addr / RMEM_PAGE_SIZE) & (RMEM_NPAGES - 1)];
+    if (page->generation != cache_generation || page->addr != page_addr) {
+        if (!read_page(rm, page_addr, page->data)) {
+            page->generation = 0;
+            /* unmapped page or tail of mapping: let ptrace decide */
+            return _UPT_access_mem(as, addr, val, write, rm->upt);
+        }
+        page->addr = page_addr;
+        page->generation = cache_generation;
+    }
+
+    memcpy(val, &page->data[addr - page_addr], sizeof(*val));
+    return 0;
+}
+
+
+/*
+ * Everything else is done by _UPT. Note that _UPT functions pass their
+ * own context to access_mem (while reading unwind tables), so arg of
+ * accessors is always _UPT context and cache is found as "current" one.
+ */
+unw_accessors_t *
+rmem_accessors()
+{
+    static unw_accessors_t accessors;
+    static bool initialized = false;
+
+    if (!initialized) {
+        accessors = _UPT_accessors;
+        accessors.access_mem = rmem_access_mem;
+        initialized = true;
+    }
+
+    return &accessors;
+}
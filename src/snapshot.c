@@ -0,0 +1,502 @@
+/*
+ * snapshot.c
+ *
+ * Binary snapshot of profile (--dump-format snapshot), read back by
+ * --view. File is built in memory and written at once; it is mmapped
+ * when viewed, names of functions point into mapping.
+ *
+ * Layout (byte order of host which saved it, every table is 8-byte aligned):
+ *   header
+ *   functions  (snapshot_fn[nfns])
+ *   nodes      (snapshot_node[nnodes]: calltree in preorder, see calltree_pack)
+ *   threads    (snapshot_thread[nthreads])
+ *   stacks     (stacks_size bytes of snapshot_stack: profiles of threads)
+ *   strings    (strtab_size bytes, each one ends with '\0')
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <byteswap.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <err.h>
+#include "crxprof.h"
+
+#define SNAPSHOT_MAGIC     "CRXSNAP\0"
+#define SNAPSHOT_VERSION   2
+#define SNAPSHOT_BYTE_ORDER  0x01020304  /* reads swapped on host of other order */
+#define SNAPSHOT_NDROPPED  4  /* by drop_reason, room for new ones */
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;  /* SNAPSHOT_BYTE_ORDER */
+    uint32_t nfns;
+    uint32_t nnodes;
+    uint32_t nthreads;
+    uint32_t nstacks;
+    uint32_t strtab_size;
+    uint32_t cmdline;     /* offset in string table */
+    uint32_t method;      /* crxprof_method */
+    uint32_t period_usec; /* sampling interval */
+    uint64_t stacks_size;
+    int64_t started;      /* time_t of profile start */
+    int64_t saved;        /* time_t of snapshot */
+    uint64_t nsnaps;
+    uint64_t nsnaps_accounted;
+    uint64_t ndropped[SNAPSHOT_NDROPPED];
+    uint64_t nfp_fallbacks;
+};
+
+struct snapshot_fn {
+    uint64_t addr;
+    uint32_t len;
+    uint32_t name;        /* offset in string table */
+};
+
+struct snapshot_node {
+    uint64_t nself;
+    uint64_t nsnaps;
+    uint32_t fn;          /* index in functions */
+    uint32_t depth;       /* 0 - root */
+};
+
+struct snapshot_thread {
+    uint64_t nsnaps;
+    uint64_t nsnaps_accounted;
+    int32_t tid;
+    uint32_t exited;
+};
+
+/* stack of thread with self cost of last function, padded to 8 bytes */
+struct snapshot_stack {
+    uint64_t cost;
+    uint64_t nsnaps;
+    int32_t tid;
+    uint32_t depth;
+    uint32_t fns[];       /* outermost first, root isn't included */
+};
+
+#define STACK_SIZE(depth) \
+    ((sizeof(struct snapshot_stack) + sizeof(uint32_t) * (depth) + 7) & ~(size_t)7)
+
+/* what is written: functions get indexes as met */
+typedef struct {
+    int *fn_index;        /* by fn_descr.id, -1 if not met yet */
+    const fn_descr **fns;
+    uint32_t nfns;
+    uint32_t nnodes;
+    uint32_t nstacks;
+    uint64_t stacks_size;
+    uint64_t strtab_size;
+    char *pos;            /* next byte of table being written */
+    uint32_t path[MAX_PACKED_DEPTH];
+} snapshot_writer;
+
+/* snapshot being viewed */
+static void *map_addr = NULL;
+static size_t map_size = 0;
+static fn_descr *loaded_fns = NULL;
+
+
+static uint32_t
+fn_index(snapshot_writer *w, const fn_descr *pfn)
+{
+    if (w->fn_index[pfn->id] < 0) {
+        w->fn_index[pfn->id] = w->nfns;
+        w->fns[w->nfns++] = pfn;
+        w->strtab_size += strlen(pfn->name) + 1;
+    }
+    return w->fn_index[pfn->id];
+}
+
+
+/* first pass: functions used and sizes of tables */
+static void
+count_node(snapshot_writer *w, const calltree_node *node)
+{
+    int i;
+
+    (void)fn_index(w, node->pfn);
+    w->nnodes++;
+    for (i = 0; i < node->nchilds; i++)
+        count_node(w, &node->childs[i]);
+}
+
+
+static void
+count_stacks(snapshot_writer *w, const calltree_node *node, int depth)
+{
+    int i;
+
+    (void)fn_index(w, node->pfn);
+    if (node->nself && depth > 0) {
+        w->nstacks++;
+        w->stacks_size += STACK_SIZE(depth);
+    }
+    for (i = 0; i < node->nchilds && depth + 1 < MAX_PACKED_DEPTH; i++)
+        count_stacks(w, &node->childs[i], depth + 1);
+}
+
+
+static void
+write_node(snapshot_writer *w, const calltree_node *node, int depth)
+{
+    struct snapshot_node *sn = (struct snapshot_node *)w->pos;
+    int i;
+
+    sn->nself = node->nself;
+    sn->nsnaps = node->nsnaps;
+    sn->fn = w->fn_index[node->pfn->id];
+    sn->depth = depth;
+    w->pos += sizeof(*sn);
+
+    for (i = 0; i < node->nchilds; i++)
+        write_node(w, &node->childs[i], depth + 1);
+}
+
+
+static void
+write_stacks(snapshot_writer *w, pid_t tid, const calltree_node *node, int depth)
+{
+    int i;
+
+    if (depth > 0)
+        w->path[depth - 1] = w->fn_index[node->pfn->id];
+
+    if (node->nself && depth > 0) {
+        struct snapshot_stack *ss = (struct snapshot_stack *)w->pos;
+
+        ss->cost = node->nself;
+        ss->nsnaps = node->nsnaps;
+        ss->tid = tid;
+        ss->depth = depth;
+        memcpy(ss->fns, w->path, sizeof(uint32_t) * depth);
+        w->pos += STACK_SIZE(depth);
+    }
+    for (i = 0; i < node->nchilds && depth + 1 < MAX_PACKED_DEPTH; i++)
+        write_stacks(w, tid, &node->childs[i], depth + 1);
+}
+
+
+bool
+dump_snapshot(const ptrace_context *ctx, calltree_node *root, FILE *ofile)
+{
+    const char *cmdline = ctx->cmdline ? ctx->cmdline : "";
+    struct snapshot_header *hdr;
+    snapshot_writer w;
+    size_t size;
+    char *buf, *strtab;
+    uint32_t i;
+    int j;
+    bool ok;
+
+    memset(&w, 0, sizeof(w));
+    w.fn_index = (int *)malloc(sizeof(int) * (g_nfndescr + 1));
+    w.fns = (const fn_descr **)malloc(sizeof(fn_descr *) * (g_nfndescr + 1));
+    if (!w.fn_index || !w.fns)
+        err(1, "Failed to allocate %d functions", g_nfndescr);
+    memset(w.fn_index, -1, sizeof(int) * (g_nfndescr + 1));
+
+    count_node(&w, root);
+    for (j = 0; j < ctx->nthreads; j++) {
+        if (ctx->threads[j]->tree.root)
+            count_stacks(&w, ctx->threads[j]->tree.root, 0);
+    }
+    w.strtab_size += strlen(cmdline) + 1;
+
+    size = sizeof(*hdr) + sizeof(struct snapshot_fn) * w.nfns +
+           sizeof(struct snapshot_node) * w.nnodes +
+           sizeof(struct snapshot_thread) * ctx->nthreads +
+           w.stacks_size + w.strtab_size;
+    buf = (char *)calloc(1, size);
+    if (!buf)
+        err(1, "Failed to allocate %zu bytes of snapshot", size);
+
+    hdr = (struct snapshot_header *)buf;
+    memcpy(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic));
+    hdr->version = SNAPSHOT_VERSION;
+    hdr->byte_order = SNAPSHOT_BYTE_ORDER;
+    hdr->nfns = w.nfns;
+    hdr->nnodes = w.nnodes;
+    hdr->nthreads = ctx->nthreads;
+    hdr->nstacks = w.nstacks;
+    hdr->strtab_size = w.strtab_size;
+    hdr->stacks_size = w.stacks_size;
+    hdr->method = ctx->prof_method;
+    hdr->period_usec = ctx->period_ns / 1000;
+    hdr->started = ctx->started;
+    hdr->saved = ctx->ended ? ctx->ended : time(NULL);
+    hdr->nsnaps = ctx->nsnaps;
+    hdr->nsnaps_accounted = ctx->nsnaps_accounted;
+    for (j = 0; j < NDROP_REASONS && j < SNAPSHOT_NDROPPED; j++)
+        hdr->ndropped[j] = ctx->ndropped[j];
+    hdr->nfp_fallbacks = ctx->nfp_fallbacks;
+
+    /* functions and their names */
+    strtab = buf + size - w.strtab_size;
+    w.pos = (char *)(hdr + 1);
+    w.strtab_size = 0;
+    for (i = 0; i < w.nfns; i++) {
+        struct snapshot_fn *sf = (struct snapshot_fn *)w.pos;
+        size_t len = strlen(w.fns[i]->name) + 1;
+
+        sf->addr = w.fns[i]->addr;
+        sf->len = w.fns[i]->len;
+        sf->name = w.strtab_size;
+        memcpy(strtab + w.strtab_size, w.fns[i]->name, len);
+        w.strtab_size += len;
+        w.pos += sizeof(*sf);
+    }
+    hdr->cmdline = w.strtab_size;
+    memcpy(strtab + w.strtab_size, cmdline, strlen(cmdline) + 1);
+
+    write_node(&w, root, 0);
+
+    for (j = 0; j < ctx->nthreads; j++) {
+        const thread_context *thr = ctx->threads[j];
+        struct snapshot_thread *st = (struct snapshot_thread *)w.pos;
+
+        st->nsnaps = thr->nsnaps;
+        st->nsnaps_accounted = thr->nsnaps_accounted;
+        st->tid = thr->tid;
+        st->exited = thr->exited;
+        w.pos += sizeof(*st);
+    }
+    for (j = 0; j < ctx->nthreads; j++) {
+        if (ctx->threads[j]->tree.root)
+            write_stacks(&w, ctx->threads[j]->tid, ctx->threads[j]->tree.root, 0);
+    }
+
+    ok = fwrite(buf, size, 1, ofile) == 1;
+
+    free(buf);
+    free(w.fns);
+    free(w.fn_index);
+    return ok;
+}
+
+
+/* thread of view by tid */
+static thread_context *
+view_thread(const ptrace_context *ctx, pid_t tid)
+{
+    int i;
+
+    for (i = 0; i < ctx->nthreads; i++) {
+        if (ctx->threads[i]->tid == tid)
+            return ctx->threads[i];
+    }
+    return NULL;
+}
+
+
+/* tables of mapped snapshot, checked to be inside of it */
+static bool
+check_snapshot(const char *path, const struct snapshot_header *hdr, size_t size)
+{
+    uint64_t tables;
+
+    if (size < sizeof(*hdr) || memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic))) {
+        warnx("%s is not a profile snapshot", path);
+        return false;
+    }
+    /* numbers of snapshot from host of other byte order are garbage */
+    if (hdr->byte_order == bswap_32(SNAPSHOT_BYTE_ORDER)) {
+        warnx("%s: snapshot is saved on host of other byte order", path);
+        return false;
+    }
+    if (hdr->version != SNAPSHOT_VERSION) {
+        warnx("%s: snapshot version %u is not supported (%u expected)", path,
+            hdr->version, SNAPSHOT_VERSION);
+        return false;
+    }
+    if (hdr->byte_order != SNAPSHOT_BYTE_ORDER) {
+        warnx("%s: snapshot is damaged", path);
+        return false;
+    }
+
+    tables = sizeof(*hdr) + (uint64_t)hdr->nfns * sizeof(struct snapshot_fn) +
+             (uint64_t)hdr->nnodes * sizeof(struct snapshot_node) +
+             (uint64_t)hdr->nthreads * sizeof(struct snapshot_thread);
+    if (hdr->stacks_size > size || tables + hdr->stacks_size + hdr->strtab_size != size ||
+        !hdr->strtab_size || ((const char *)hdr)[size - 1] != '\0' ||
+        hdr->cmdline >= hdr->strtab_size)
+    {
+        warnx("%s: snapshot is damaged", path);
+        return false;
+    }
+
+    return true;
+}
+
+
+/*
+ * Load snapshot: profile is added to `tree', counters and threads
+ * (with their profiles) to `ctx'. Keep both until snapshot_free.
+ */
+bool
+snapshot_load(const char *path, ptrace_context *ctx, calltree *tree)
+{
+    const struct snapshot_header *hdr;
+    const struct snapshot_fn *fns;
+    const struct snapshot_node *nodes;
+    const struct snapshot_thread *threads;
+    const char *stacks, *strtab;
+    packed_node *packed;
+    struct stat st;
+    uint64_t off;
+    uint32_t i, k;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        warn("Failed to open %s", path);
+        if (fd != -1)
+            close(fd);
+        return false;
+    }
+
+    map_size = st.st_size;
+    map_addr = map_size ? mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map_addr == MAP_FAILED) {
+        map_addr = NULL;
+        warnx("%s is not a profile snapshot", path);
+        return false;
+    }
+
+    hdr = (const struct snapshot_header *)map_addr;
+    if (!check_snapshot(path, hdr, map_size))
+        return false;
+
+    fns = (const struct snapshot_fn *)(hdr + 1);
+    nodes = (const struct snapshot_node *)(fns + hdr->nfns);
+    threads = (const struct snapshot_thread *)(nodes + hdr->nnodes);
+    stacks = (const char *)(threads + hdr->nthreads);
+    strtab = stacks + hdr->stacks_size;
+
+    /* functions exist only in snapshot: they get new ids */
+    loaded_fns = (fn_descr *)malloc(sizeof(fn_descr) * (hdr->nfns + 1));
+    packed = (packed_node *)malloc(sizeof(packed_node) * (hdr->nnodes > MAX_PACKED_DEPTH ? hdr->nnodes : MAX_PACKED_DEPTH));
+    if (!loaded_fns || !packed)
+        err(1, "Failed to allocate %u functions and %u nodes", hdr->nfns, hdr->nnodes);
+
+    for (i = 0; i < hdr->nfns; i++) {
+        if (fns[i].name >= hdr->strtab_size)
+            goto damaged;
+        loaded_fns[i].name = (char *)strtab + fns[i].name;
+        loaded_fns[i].addr = fns[i].addr;
+        loaded_fns[i].len = fns[i].len;
+        loaded_fns[i].id = g_nfndescr++;
+    }
+
+    for (i = 0; i < hdr->nnodes; i++) {
+        if (nodes[i].fn >= hdr->nfns || nodes[i].depth >= MAX_PACKED_DEPTH)
+            goto damaged;
+        packed[i].pfn = &loaded_fns[nodes[i].fn];
+        packed[i].nself = nodes[i].nself;
+        packed[i].nsnaps = nodes[i].nsnaps;
+        packed[i].depth = nodes[i].depth;
+    }
+    if ((hdr->nnodes && nodes[0].depth != 0) || !calltree_unpack(tree, packed, hdr->nnodes))
+        goto damaged;
+
+    ctx->cmdline = strdup(strtab + hdr->cmdline);
+    ctx->prof_method = (crxprof_method)hdr->method;
+    ctx->period_ns = (uint64_t)hdr->period_usec * 1000;
+    ctx->started = hdr->started;
+    ctx->ended = hdr->saved;
+    ctx->nsnaps = hdr->nsnaps;
+    ctx->nsnaps_accounted = hdr->nsnaps_accounted;
+    for (i = 0; i < NDROP_REASONS && i < SNAPSHOT_NDROPPED; i++)
+        ctx->ndropped[i] = hdr->ndropped[i];
+    ctx->nfp_fallbacks = hdr->nfp_fallbacks;
+
+    ctx->threads = (thread_context **)calloc(hdr->nthreads + 1, sizeof(thread_context *));
+    if (!ctx->threads)
+        err(1, "Failed to allocate %u threads", hdr->nthreads);
+    for (i = 0; i < hdr->nthreads; i++) {
+        thread_context *thr = (thread_context *)calloc(1, sizeof(thread_context));
+
+        if (!thr)
+            err(1, "Failed to allocate thread");
+        thr->tid = threads[i].tid;
+        thr->exited = threads[i].exited;
+        thr->nsnaps = threads[i].nsnaps;
+        thr->nsnaps_accounted = threads[i].nsnaps_accounted;
+        thr->perf_fd = -1;
+        calltree_init(&thr->tree);
+        ctx->threads[ctx->nthreads++] = thr;
+    }
+
+    /* stack is path from root: same as packed tree of one leaf */
+    for (i = 0, off = 0; i < hdr->nstacks; i++) {
+        const struct snapshot_stack *ss = (const struct snapshot_stack *)(stacks + off);
+        thread_context *thr;
+
+        if (off + sizeof(*ss) > hdr->stacks_size || !hdr->nnodes ||
+            ss->depth == 0 || ss->depth >= MAX_PACKED_DEPTH ||
+            off + STACK_SIZE(ss->depth) > hdr->stacks_size)
+        {
+            goto damaged;
+        }
+        off += STACK_SIZE(ss->depth);
+
+        packed[0].pfn = &loaded_fns[nodes[0].fn];
+        for (k = 0; k <= ss->depth; k++) {
+            if (k > 0) {
+                if (ss->fns[k - 1] >= hdr->nfns)
+                    goto damaged;
+                packed[k].pfn = &loaded_fns[ss->fns[k - 1]];
+            }
+            packed[k].nself = packed[k].nsnaps = 0;
+            packed[k].depth = k;
+        }
+        packed[ss->depth].nself = ss->cost;
+        packed[ss->depth].nsnaps = ss->nsnaps;
+
+        if ((thr = view_thread(ctx, ss->tid)) != NULL)
+            (void)calltree_unpack(&thr->tree, packed, ss->depth + 1);
+    }
+
+    free(packed);
+    return true;
+
+damaged:
+    warnx("%s: snapshot is damaged", path);
+    free(packed);
+    return false;
+}
+
+
+void
+snapshot_free(ptrace_context *ctx)
+{
+    int i;
+
+    for (i = 0; i < ctx->nthreads; i++) {
+        calltree_destroy(&ctx->threads[i]->tree);
+        free(ctx->threads[i]);
+    }
+    free(ctx->threads);
+    ctx->threads = NULL;
+    ctx->nthreads = 0;
+    free(ctx->cmdline);
+    ctx->cmdline = NULL;
+
+    free(loaded_fns);
+    loaded_fns = NULL;
+    if (map_addr) {
+        munmap(map_addr, map_size);
+        map_addr = NULL;
+    }
+}
@@ -0,0 +1,403 @@
+/*
+ * srcinfo.c
+ *
+ * Inlined functions and source lines of IPs from DWARF (elfutils libdw).
+ * Debug info is searched in the ELF itself and in separate debug files
+ * found by build-id or .gnu_debuglink (/usr/lib/debug).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include "crxprof.h"
+
+#if HAVE_LIBDW
+
+#include <elfutils/libdwfl.h>
+#include <dwarf.h>
+
+/* expansion of IP: every distinct IP is resolved once */
+typedef struct {
+    unsigned long pc;   /* 0 - empty cell */
+    int nframes;
+    src_frame *frames;
+} resolved_pc;
+
+static char *debuginfo_path = NULL;  /* default: .debug, /usr/lib/debug */
+static const Dwfl_Callbacks dwfl_callbacks = {
+    .find_elf = dwfl_linux_proc_find_elf,
+    .find_debuginfo = dwfl_standard_find_debuginfo,
+    .debuginfo_path = &debuginfo_path,
+};
+
+static Dwfl *dwfl = NULL;
+static pid_t traced_pid;
+static bool need_report = false;  /* maps changed since modules reported */
+static resolved_pc *resolved = NULL;
+static int nresolved = 0, resolved_size = 0;
+static mem_arena frames_arena;
+
+/* source file of function by fn_descr.id: the first one met (own copy) */
+static const char **files = NULL;
+static int files_size = 0;
+static mem_arena files_arena;
+
+
+static bool
+report_modules()
+{
+    dwfl_report_begin(dwfl);
+    if (dwfl_linux_proc_report(dwfl, traced_pid) != 0 ||
+        dwfl_report_end(dwfl, NULL, NULL) != 0)
+    {
+        warnx("Failed to read modules of %d: %s", (int)traced_pid, dwfl_errmsg(-1));
+        return false;
+    }
+    return true;
+}
+
+
+bool
+srcinfo_init(pid_t pid)
+{
+    dwfl = dwfl_begin(&dwfl_callbacks);
+    if (!dwfl) {
+        warnx("dwfl_begin failed: %s", dwfl_errmsg(-1));
+        return false;
+    }
+
+    traced_pid = pid;
+    if (!report_modules()) {
+        dwfl_end(dwfl);
+        dwfl = NULL;
+        return false;
+    }
+
+    arena_init(&frames_arena);
+    arena_init(&files_arena);
+    return true;
+}
+
+
+/* re-reported on next expand: IP being resolved may be of old module */
+void
+srcinfo_refresh()
+{
+    need_report = (dwfl != NULL);
+}
+
+
+bool
+srcinfo_enabled()
+{
+    return dwfl != NULL;
+}
+
+
+static void
+set_file(const fn_descr *pfn, const char *file)
+{
+    if (!file)
+        return;
+
+    if (pfn->id >= files_size) {
+        int old_size = files_size;
+
+        files_size = (g_nfndescr > pfn->id) ? g_nfndescr : pfn->id + 1;
+        files = (const char **)realloc(files, sizeof(char *) * files_size);
+        if (!files)
+            err(1, "Failed to allocate %d source files", files_size);
+        memset(files + old_size, 0, sizeof(char *) * (files_size - old_size));
+    }
+
+    /* libdw frees names of modules gone at next report_modules() */
+    if (!files[pfn->id])
+        files[pfn->id] = arena_strdup(&files_arena, file);
+}
+
+
+const char *
+srcinfo_file(const fn_descr *pfn)
+{
+    return (pfn->id < files_size) ? files[pfn->id] : NULL;
+}
+
+
+/* linkage (mangled) name if any: same as in symbol tables */
+static const char *
+die_name(Dwarf_Die *die)
+{
+    Dwarf_Attribute attr;
+    const char *name;
+
+    name = dwarf_formstring(dwarf_attr_integrate(die, DW_AT_linkage_name, &attr));
+    if (!name)
+        name = dwarf_formstring(dwarf_attr_integrate(die, DW_AT_MIPS_linkage_name, &attr));
+    if (!name)
+        name = dwarf_formstring(dwarf_attr_integrate(die, DW_AT_name, &attr));
+
+    return name ? name : "??";
+}
+
+
+/* file of call site of inlined function */
+static const char *
+call_file(Dwarf_Die *cudie, Dwarf_Die *die)
+{
+    Dwarf_Attribute attr;
+    Dwarf_Files *srcfiles;
+    Dwarf_Word idx;
+    size_t nfiles;
+
+    if (dwarf_formudata(dwarf_attr(die, DW_AT_call_file, &attr), &idx) != 0 ||
+        dwarf_getsrcfiles(cudie, &srcfiles, &nfiles) != 0 || idx >= nfiles)
+    {
+        return NULL;
+    }
+
+    return dwarf_filesrc(srcfiles, idx, NULL, NULL);
+}
+
+
+/*
+ * Frames of pc, innermost first: inlined functions, then the one
+ * from symbol table. Line of every frame is where it calls next inner one.
+ */
+static int
+resolve(unsigned long pc, src_frame *frames, int max)
+{
+    Dwfl_Module *mod = dwfl_addrmodule(dwfl, pc);
+    Dwarf_Die *cudie = NULL, *scopes = NULL;
+    const char *file = NULL, *subprogram = NULL;
+    Dwarf_Addr bias = 0;
+    int line = 0, nscopes = 0, i, n = 0;
+
+    if (mod) {
+        Dwfl_Line *l = dwfl_module_getsrc(mod, pc);
+
+        if (l)
+            file = dwfl_lineinfo(l, NULL, &line, NULL, NULL, NULL);
+        cudie = dwfl_module_addrdie(mod, pc, &bias);
+    }
+    if (cudie)
+        nscopes = dwarf_getscopes(cudie, pc - bias, &scopes);
+
+    /*
+     * Scopes above innermost inlined instance are ones of its abstract
+     * origin: callers are in scopes of instance itself.
+     */
+    for (i = 0; i < nscopes; i++) {
+        int tag = dwarf_tag(&scopes[i]);
+
+        if (tag == DW_TAG_inlined_subroutine) {
+            Dwarf_Die inlined = scopes[i];
+
+            free(scopes);
+            scopes = NULL;
+            nscopes = dwarf_getscopes_die(&inlined, &scopes);
+            break;
+        }
+        if (tag == DW_TAG_subprogram)
+            break;
+    }
+
+    for (i = 0; i < nscopes && n < max - 1; i++) {
+        Dwarf_Die *die = &scopes[i];
+        Dwarf_Attribute attr;
+        Dwarf_Word call_line;
+        int tag = dwarf_tag(die);
+
+        if (tag == DW_TAG_subprogram) {
+            subprogram = die_name(die);
+            break;
+        }
+        if (tag != DW_TAG_inlined_subroutine)
+            continue; /* lexical block etc */
+
+        frames[n].pfn = fn_named(die_name(die));
+        frames[n].line = (line > 0) ? line : 0;
+        set_file(frames[n].pfn, file);
+        n++;
+
+        /* position in caller is call site of inlined one */
+        line = (dwarf_formudata(dwarf_attr(die, DW_AT_call_line, &attr), &call_line) == 0)
+             ? (int)call_line : 0;
+        file = call_file(cudie, die);
+    }
+
+    /* outermost is real function: one from symbol table (if any) */
+    frames[n].pfn = lookup_fn_descr(pc);
+    if (!frames[n].pfn && subprogram)
+        frames[n].pfn = fn_named(subprogram);
+    if (frames[n].pfn) {
+        frames[n].line = (line > 0) ? line : 0;
+        set_file(frames[n].pfn, file);
+        n++;
+    }
+
+    free(scopes);
+    return n;
+}
+
+
+static void
+resolved_insert(const resolved_pc *r)
+{
+    unsigned mask = resolved_size - 1,
+             h = (unsigned)((r->pc >> 2) * 2654435761u) & mask;
+
+    while (resolved[h].pc)
+        h = (h + 1) & mask;
+    resolved[h] = *r;
+}
+
+
+/*
+ * Expand IP of backtrace to frames (innermost first).
+ * Return addresses are looked up by previous byte: it belongs to call
+ * instruction, next one may be a line (or even function) after it.
+ */
+int
+srcinfo_expand(unsigned long ip, bool is_return, src_frame *frames, int max)
+{
+    unsigned long pc = is_return ? ip - 1 : ip;
+    resolved_pc r;
+    unsigned h;
+
+    if (need_report) {
+        /* modules kept are not re-read; resolved IPs may be of gone ones */
+        need_report = false;
+        (void)report_modules();
+        if (resolved)
+            memset(resolved, 0, sizeof(resolved_pc) * resolved_size);
+        nresolved = 0;
+    }
+
+    if (resolved_size) {
+        for (h = (unsigned)((pc >> 2) * 2654435761u) & (resolved_size - 1); resolved[h].pc;
+             h = (h + 1) & (resolved_size - 1))
+        {
+            if (resolved[h].pc == pc) {
+                int n = (resolved[h].nframes < max) ? resolved[h].nframes : max;
+                memcpy(frames, resolved[h].frames, sizeof(src_frame) * n);
+                return n;
+            }
+        }
+    }
+
+    if ((nresolved + 1) * 2 > resolved_size) {
+        resolved_pc *old = resolved;
+        int i, old_size = resolved_size;
+
+        resolved_size = resolved_size ? resolved_size * 2 : 1024;
+        resolved = (resolved_pc *)calloc(resolved_size, sizeof(resolved_pc));
+        if (!resolved)
+            err(1, "Failed to allocate %d resolved IPs", resolved_size);
+        for (i = 0; i < old_size; i++) {
+            if (old[i].pc)
+                resolved_insert(&old[i]);
+        }
+        free(old);
+    }
+
+    r.pc = pc;
+    r.nframes = resolve(pc, frames, max);
+    r.frames = (src_frame *)arena_alloc(&frames_arena, sizeof(src_frame) * (r.nframes + 1));
+    memcpy(r.frames, frames, sizeof(src_frame) * r.nframes);
+    resolved_insert(&r);
+    nresolved++;
+
+    return r.nframes;
+}
+
+
+/*
+ * Frames of resolved IPs may point to functions being freed: resolve
+ * them again. Files of functions kept are copied to new arena.
+ */
+void
+srcinfo_reclaim(const char *used)
+{
+    mem_arena kept;
+    int i;
+
+    if (!dwfl)
+        return;
+
+    if (resolved)
+        memset(resolved, 0, sizeof(resolved_pc) * resolved_size);
+    nresolved = 0;
+    arena_free(&frames_arena);
+    arena_init(&frames_arena);
+
+    arena_init(&kept);
+    for (i = 0; i < files_size; i++) {
+        if (files[i])
+            files[i] = used[i] ? arena_strdup(&kept, files[i]) : NULL;
+    }
+    arena_free(&files_arena);
+    files_arena = kept;
+}
+
+
+void
+srcinfo_free()
+{
+    if (dwfl) {
+        dwfl_end(dwfl);
+        dwfl = NULL;
+    }
+
+    free(resolved);
+    resolved = NULL;
+    nresolved = resolved_size = 0;
+    free(files);
+    files = NULL;
+    files_size = 0;
+    arena_free(&frames_arena);
+    arena_free(&files_arena);
+}
+
+#else /* HAVE_LIBDW */
+
+bool
+srcinfo_init(pid_t pid)
+{
+    warnx("crxprof is built without libdw: DWARF info is not available");
+    return false;
+}
+
+bool
+srcinfo_enabled()
+{
+    return false;
+}
+
+int
+srcinfo_expand(unsigned long ip, bool is_return, src_frame *frames, int max)
+{
+    return 0;
+}
+
+const char *
+srcinfo_file(const fn_descr *pfn)
+{
+    return NULL;
+}
+
+void
+srcinfo_refresh()
+{
+}
+
+void
+srcinfo_reclaim(const char *used)
+{
+}
+
+void
+srcinfo_free()
+{
+}
+
+#endif /* HAVE_LIBDW */
@@ -0,0 +1,246 @@
+/*
+ * stackrec.c
+ * Raw backtraces recorded while sampling, symbolized when profile is shown
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include "crxprof.h"
+
+
+static uint32_t
+stack_hash(pid_t tid, const trace_stack *stk)
+{
+    /* FNV-1a over thread and IPs */
+    uint32_t h = 2166136261u ^ (uint32_t)tid;
+    int i;
+
+    for (i = 0; i < stk->depth; i++) {
+        h = (h ^ (uint32_t)stk->ips[i]) * 16777619u;
+        h = (h ^ (uint32_t)((uint64_t)stk->ips[i] >> 32)) * 16777619u;
+    }
+    return h;
+}
+
+
+void
+stackrec_init(stack_store *store)
+{
+    memset(store, 0, sizeof(stack_store));
+    arena_init(&store->arena);
+}
+
+
+void
+stackrec_destroy(stack_store *store)
+{
+    free(store->stacks);
+    free(store->index);
+    arena_free(&store->arena);
+    memset(store, 0, sizeof(stack_store));
+}
+
+
+/* index has size*2 cells: index in stacks + 1, 0 if empty */
+static void
+index_insert(stack_store *store, int istack)
+{
+    unsigned mask = store->size * 2 - 1,
+             h = store->stacks[istack]->hash & mask;
+
+    while (store->index[h])
+        h = (h + 1) & mask;
+    store->index[h] = istack + 1;
+}
+
+
+static void
+grow(stack_store *store)
+{
+    int i;
+
+    store->size = store->size ? store->size * 2 : 1024;
+    store->stacks = (raw_stack **)realloc(store->stacks, sizeof(raw_stack *) * store->size);
+    free(store->index);
+    store->index = (int *)calloc(store->size * 2, sizeof(int));
+    if (!store->stacks || !store->index)
+        err(1, "Failed to allocate %d raw stacks", store->size);
+
+    for (i = 0; i < store->nstacks; i++)
+        index_insert(store, i);
+}
+
+
+/* sampling path: no symbol lookups, just hashing */
+bool
+stackrec_add(stack_store *store, pid_t tid, uint64_t cost, const trace_stack *stk)
+{
+    uint32_t hash;
+    unsigned mask, h;
+    raw_stack *rs;
+
+    if (stk->depth <= 0 || stk->depth >= MAX_STACK_DEPTH)
+        return false; /* dropped by fill_backtrace anyway */
+
+    if (store->nstacks == store->size)
+        grow(store);
+
+    hash = stack_hash(tid, stk);
+    mask = store->size * 2 - 1;
+    for (h = hash & mask; store->index[h]; h = (h + 1) & mask) {
+        rs = store->stacks[store->index[h] - 1];
+        if (rs->hash == hash && rs->tid == tid && rs->depth == stk->depth &&
+            !memcmp(rs->ips, stk->ips, sizeof(unw_word_t) * stk->depth))
+        {
+            rs->cost += cost;
+            rs->nsnaps++;
+            return true;
+        }
+    }
+
+    rs = (raw_stack *)arena_alloc(&store->arena,
+        sizeof(raw_stack) + sizeof(unw_word_t) * stk->depth);
+    rs->tid = tid;
+    rs->hash = hash;
+    rs->cost = cost;
+    rs->nsnaps = 1;
+    rs->depth = stk->depth;
+    memcpy(rs->ips, stk->ips, sizeof(unw_word_t) * stk->depth);
+
+    store->stacks[store->nstacks] = rs;
+    store->index[h] = ++store->nstacks;
+    return true;
+}
+
+
+/* Account backtrace in ctx->stk: immediately or recording it for later */
+void
+account_backtrace(ptrace_context *ctx, thread_context *thr, pid_t tid,
+                  uint64_t cost, calltree *tree)
+{
+    drop_reason r;
+
+    ctx->nsnaps++;
+    if (thr)
+        thr->nsnaps++;
+
+    if (ctx->defer_symbols) {
+        if (!stackrec_add(&ctx->raw, tid, cost, &ctx->stk))
+            ctx->ndropped[DROP_BAD_STACK]++;
+        return;
+    }
+
+    r = fill_backtrace(cost, 1, &ctx->stk, tree, thr ? &thr->tree : NULL);
+    if (r != DROP_NONE) {
+        ctx->ndropped[r]++;
+        return;
+    }
+    ctx->nsnaps_accounted++;
+    if (thr)
+        thr->nsnaps_accounted++;
+}
+
+
+/* load symbols of all modules met in recorded stacks at once */
+static void
+preload_modules(const stack_store *store)
+{
+    fn_module **mods;
+    char *queued;
+    int i, j, nmods = 0;
+
+    mods = (fn_module **)malloc(sizeof(fn_module *) * (g_nmodules + 1));
+    queued = (char *)calloc(g_nmodules + 1, 1);
+    if (!mods || !queued)
+        err(1, "Failed to allocate %d modules", g_nmodules);
+
+    for (i = 0; i < store->nstacks; i++) {
+        const raw_stack *rs = store->stacks[i];
+
+        for (j = 0; j < rs->depth; j++) {
+            fn_module *mod = find_module(rs->ips[j]);
+            if (mod && !mod->loaded && !queued[mod - g_modules]) {
+                queued[mod - g_modules] = 1;
+                mods[nmods++] = mod;
+            }
+        }
+    }
+
+    if (nmods)
+        load_fndescr_many(mods, nmods);
+    free(queued);
+    free(mods);
+}
+
+
+static int
+thread_tid_cmp(const thread_context **a, const thread_context **b)
+{
+    return ((*a)->tid == (*b)->tid) ? 0 : ((*a)->tid < (*b)->tid ? -1 : 1);
+}
+
+
+/* thread of recorded stack, exited ones too: `sorted' by tid */
+static thread_context *
+stack_thread(thread_context **sorted, int nthreads, pid_t tid)
+{
+    int l = 0, h = nthreads;
+
+    while (l < h) {
+        int i = (l + h)/2;
+        if (sorted[i]->tid < tid)
+            l = i + 1;
+        else
+            h = i;
+    }
+
+    return (l < nthreads && sorted[l]->tid == tid) ? sorted[l] : NULL;
+}
+
+
+/*
+ * (Re)build trees of process and every thread from recorded stacks:
+ * one pass, every stack is symbolized once for both trees.
+ */
+void
+stackrec_aggregate(ptrace_context *ctx, calltree *tree)
+{
+    const stack_store *store = &ctx->raw;
+    thread_context **sorted, *thr = NULL;
+    trace_stack stk;
+    int i;
+
+    preload_modules(store);
+
+    sorted = (thread_context **)malloc(sizeof(thread_context *) * (ctx->nthreads + 1));
+    if (!sorted)
+        err(1, "Failed to allocate %d threads", ctx->nthreads);
+
+    calltree_destroy(tree);
+    ctx->nsnaps_accounted = 0;
+    for (i = 0; i < ctx->nthreads; i++) {
+        sorted[i] = ctx->threads[i];
+        calltree_destroy(&sorted[i]->tree);
+        sorted[i]->nsnaps_accounted = 0;
+    }
+    qsort(sorted, ctx->nthreads, sizeof(thread_context *), (qsort_compar_t)thread_tid_cmp);
+
+    for (i = 0; i < store->nstacks; i++) {
+        const raw_stack *rs = store->stacks[i];
+
+        /* stacks of the same thread mostly go in a row */
+        if (!thr || thr->tid != rs->tid)
+            thr = stack_thread(sorted, ctx->nthreads, rs->tid);
+
+        stk.depth = rs->depth;
+        memcpy(stk.ips, rs->ips, sizeof(unw_word_t) * rs->depth);
+        if (fill_backtrace(rs->cost, rs->nsnaps, &stk, tree, thr ? &thr->tree : NULL) != DROP_NONE)
+            continue;
+
+        ctx->nsnaps_accounted += rs->nsnaps;
+        if (thr)
+            thr->nsnaps_accounted += rs->nsnaps;
+    }
+
+    free(sorted);
+}
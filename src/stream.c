@@ -0,0 +1,321 @@
+/*
+ * stream.c
+ * Live profile served over Unix socket (--socket). Client connects and
+ * sends request line, profile is written back in folded format and
+ * connection is closed:
+ *   "full"     - whole profile,
+ *   "delta ID" - cost added since previous "delta" with the same ID
+ *                (any string, may be empty): one per collector.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
+#include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <errno.h>
+#include <err.h>
+#include "crxprof.h"
+
+#define MAX_CLIENTS           8     /* served at once, others wait in backlog */
+#define MAX_CURSORS           16    /* bases of "delta ID", least recent is reused */
+#define MAX_CURSOR_ID         32
+#define REQUEST_TIMEOUT_MSEC  1000
+#define SEND_TIMEOUT_MSEC     5000
+#define SEND_BYTES_PER_POLL   (64 * 1024)  /* sampling isn't delayed by big profiles */
+#define AGGREGATE_MIN_MSEC    1000  /* --defer-symbols: stacks are folded for clients
+                                       not more often, it takes a while */
+
+/* client connected: request is read, then response is sent, both without blocking */
+typedef struct {
+    int fd;
+    uint64_t deadline;        /* msec, monotonic */
+    char request[64];
+    size_t request_len;
+    char *response;           /* NULL while request isn't read */
+    size_t response_len, sent;
+} stream_client;
+
+/* what was read by "delta ID" last time: cost of nodes by seq */
+typedef struct {
+    char id[MAX_CURSOR_ID];
+    seen_cost *seen;
+    int nseen;
+    uint64_t last_used;       /* 0 - cursor is free */
+} stream_cursor;
+
+static int listen_fd = -1;
+static char *socket_path = NULL;
+static stream_client clients[MAX_CLIENTS];
+static int nclients = 0;
+static stream_cursor cursors[MAX_CURSORS];
+static uint64_t last_aggregate = 0;
+
+
+static uint64_t
+monotonic_msec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+bool
+stream_open(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1)
+        return false;
+
+    /* socket left by previous run is replaced, anything else is kept */
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            close(listen_fd);
+            listen_fd = -1;
+            errno = EEXIST;
+            return false;
+        }
+        (void)unlink(path);
+    }
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(listen_fd, 16) == -1)
+    {
+        int saved_errno = errno;
+
+        close(listen_fd);
+        listen_fd = -1;
+        errno = saved_errno;
+        return false;
+    }
+
+    /* clients may go away at any moment */
+    signal(SIGPIPE, SIG_IGN);
+    socket_path = strdup(path);
+    return true;
+}
+
+
+static void
+close_client(int i)
+{
+    close(clients[i].fd);
+    free(clients[i].response);
+    clients[i] = clients[--nclients];
+}
+
+
+/* read what client sent: 1 - request line is complete, -1 - client is gone */
+static int
+read_request(stream_client *cl)
+{
+    ssize_t n = read(cl->fd, cl->request + cl->request_len,
+                     sizeof(cl->request) - 1 - cl->request_len);
+
+    if (n > 0) {
+        cl->request_len += n;
+        cl->request[cl->request_len] = '\0';
+    }
+    else if (n == 0 || (errno != EAGAIN && errno != EINTR))
+        return cl->request_len ? 1 : -1; /* line without "\n" is ended by EOF */
+
+    if (!strpbrk(cl->request, "\r\n") && cl->request_len < sizeof(cl->request) - 1)
+        return 0;
+
+    cl->request[strcspn(cl->request, "\r\n")] = '\0';
+    return 1;
+}
+
+
+/* base of "delta ID": collector not heard of for long gets all cost next time */
+static stream_cursor *
+get_cursor(const char *id)
+{
+    static uint64_t nreads = 0;
+    stream_cursor *lru = &cursors[0];
+    int i;
+
+    for (i = 0; i < MAX_CURSORS; i++) {
+        if (cursors[i].last_used && !strcmp(cursors[i].id, id)) {
+            lru = &cursors[i];
+            break;
+        }
+        if (cursors[i].last_used < lru->last_used)
+            lru = &cursors[i];
+    }
+
+    if (i == MAX_CURSORS) {
+        free(lru->seen);
+        memset(lru, 0, sizeof(stream_cursor));
+        strcpy(lru->id, id);
+    }
+    lru->last_used = ++nreads;
+    return lru;
+}
+
+
+/* whole response is made at once (it is consistent), sent by parts later */
+static void
+make_response(stream_client *cl, const calltree *tree)
+{
+    const char *id = cl->request + strlen("delta");
+    FILE *ofile = open_memstream(&cl->response, &cl->response_len);
+
+    if (!ofile)
+        err(1, "Failed to allocate response");
+
+    if (!strcmp(cl->request, "full")) {
+        if (tree->root)
+            dump_folded(tree->root, NULL, ofile);
+    }
+    else if (!strncmp(cl->request, "delta", strlen("delta")) && (!*id || *id == ' ')) {
+        stream_cursor *c;
+
+        id += (*id == ' ');
+        if (strlen(id) >= MAX_CURSOR_ID)
+            fprintf(ofile, "error: delta ID is longer than %d chars\n", MAX_CURSOR_ID - 1);
+        else {
+            c = get_cursor(id);
+            if (c->nseen < tree->nnodes) {
+                c->seen = (seen_cost *)realloc(c->seen, sizeof(seen_cost) * tree->nnodes);
+                if (!c->seen)
+                    err(1, "Failed to allocate %d nodes", tree->nnodes);
+                memset(c->seen + c->nseen, 0, sizeof(seen_cost) * (tree->nnodes - c->nseen));
+                c->nseen = tree->nnodes;
+            }
+            if (tree->root)
+                dump_folded(tree->root, c->seen, ofile);
+        }
+    }
+    else
+        fprintf(ofile, "error: unknown request \"%s\" (full or delta [ID] expected)\n", cl->request);
+
+    fclose(ofile);
+}
+
+
+/*
+ * Serve connected clients a bit: nothing blocks, and no more than
+ * SEND_BYTES_PER_POLL is sent, so sampling goes on meanwhile.
+ */
+void
+stream_poll(ptrace_context *ctx, calltree *tree)
+{
+    size_t budget = SEND_BYTES_PER_POLL;
+    uint64_t now;
+    int fd, i = 0;
+
+    if (listen_fd == -1)
+        return;
+
+    now = monotonic_msec();
+    while (nclients < MAX_CLIENTS &&
+           (fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+    {
+        stream_client *cl = &clients[nclients++];
+
+        memset(cl, 0, sizeof(stream_client));
+        cl->fd = fd;
+        cl->deadline = now + REQUEST_TIMEOUT_MSEC;
+    }
+
+    while (i < nclients) {
+        stream_client *cl = &clients[i];
+
+        if (!cl->response) {
+            int res = read_request(cl);
+
+            if (res < 0 || (res == 0 && now >= cl->deadline)) {
+                close_client(i);
+                continue;
+            }
+            if (res == 0) {
+                i++;
+                continue;
+            }
+
+            /* stacks are folded once for all clients waiting */
+            if (ctx->defer_symbols && now - last_aggregate >= AGGREGATE_MIN_MSEC) {
+                stackrec_aggregate(ctx, tree);
+                last_aggregate = now;
+            }
+            make_response(cl, tree);
+            cl->deadline = now + SEND_TIMEOUT_MSEC;
+        }
+
+        if (cl->sent < cl->response_len && budget) {
+            size_t len = cl->response_len - cl->sent;
+            ssize_t n = write(cl->fd, cl->response + cl->sent, (len < budget) ? len : budget);
+
+            if (n > 0) {
+                cl->sent += n;
+                budget -= n;
+            }
+            else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                close_client(i);
+                continue;
+            }
+        }
+
+        if (cl->sent == cl->response_len || now >= cl->deadline)
+            close_client(i);
+        else
+            i++;
+    }
+}
+
+
+/* profile is started from scratch (next --window): so do deltas */
+void
+stream_reset()
+{
+    int i;
+
+    for (i = 0; i < MAX_CURSORS; i++) {
+        free(cursors[i].seen);
+        cursors[i].seen = NULL;
+        cursors[i].nseen = 0;
+    }
+    last_aggregate = 0;
+}
+
+
+void
+stream_close()
+{
+    if (listen_fd == -1)
+        return;
+
+    while (nclients)
+        close_client(0);
+    stream_reset();
+    memset(cursors, 0, sizeof(cursors));
+
+    close(listen_fd);
+    listen_fd = -1;
+    (void)unlink(socket_path);
+    free(socket_path);
+    socket_path = NULL;
+}
@@ -4,7 +4,8 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <stdio.h>
-#include <bfd.h>
+#include <stdint.h>
+#include "../config.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -46,16 +47,22 @@ void maps_close(struct maps_ctx *ctx);
 
 typedef struct elf_symbol {
     const char *symbol_name;
-    symvalue symbol_value;
+    uint64_t symbol_value;
     size_t symbol_size;
-    char symbol_class;
+    char symbol_class;  /* like nm(1) */
 } elf_symbol_t;
 
 typedef struct elf_reader {
-    bfd *__abfd;
-    asymbol **__symbol_table;
-    elf_symbol_t *symbols;
-    int nsymbols;
+    void *__map;            /* whole file */
+    size_t __map_size;
+    bool __is64;            /* ELFCLASS64 */
+    const char *__sections;
+    unsigned __nsections;
+    const char *__symbols;
+    const char *__strtab;
+    size_t __strtab_size;
+    int __next;
+    int nsymbols;           /* size of table, not all are returned */
 } elf_reader_t;
 
 /* ELF-symbol extraction */
@@ -63,6 +70,7 @@ void elfreader_init();
 
 elf_reader_t *elf_read_textf(const char *path);
 elf_reader_t *elf_read_dynaf(const char *path);
+bool elf_read_next(elf_reader_t *reader, elf_symbol_t *sym);
 void elfreader_close(elf_reader_t *reader); /* free elf_reader_t */
 
 #ifdef __cplusplus
@@ -0,0 +1,321 @@
+/*
+ * symcache.c
+ *
+ * On-disk cache of symbol tables: sorted and ready to be
+ * mmapped. File is keyed by GNU build-id of ELF (or by its
+ * dev/inode/mtime/size if there is no build-id).
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <elf.h>
+#include <link.h>
+
+#include "crxprof.h"
+
+#define SYMCACHE_MAGIC    "CRXSYMS2"  /* mangled names */
+#if __ELF_NATIVE_CLASS == 64
+#define NATIVE_ELFCLASS   ELFCLASS64
+#else
+#define NATIVE_ELFCLASS   ELFCLASS32
+#endif
+#define MAX_NOTES_SIZE    65536
+
+struct symcache_header {
+    char magic[8];
+    uint32_t nentries;
+    uint32_t strtab_size;
+};
+
+struct symcache_entry {
+    uint64_t value;
+    uint32_t size;
+    uint32_t name;    /* offset in string table */
+};
+
+static char *cache_dir = NULL;  /* NULL: cache disabled */
+
+
+static bool
+mkdir_p(char *path)
+{
+    char *p;
+
+    for (p = path + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            (void)mkdir(path, 0755);
+            *p = '/';
+        }
+    }
+
+    return mkdir(path, 0755) == 0 || access(path, W_OK) == 0;
+}
+
+
+/* dir == NULL selects $XDG_CACHE_HOME/crxprof (~/.cache/crxprof) */
+void
+symcache_init(const char *dir)
+{
+    char path[PATH_MAX];
+    const char *base;
+
+    if (dir)
+        snprintf(path, sizeof(path), "%s", dir);
+    else if ((base = getenv("XDG_CACHE_HOME")) != NULL && base[0])
+        snprintf(path, sizeof(path), "%s/crxprof", base);
+    else if ((base = getenv("HOME")) != NULL && base[0])
+        snprintf(path, sizeof(path), "%s/.cache/crxprof", base);
+    else
+        return;
+
+    free(cache_dir);
+    cache_dir = mkdir_p(path) ? strdup(path) : NULL;
+}
+
+
+void
+symcache_free()
+{
+    free(cache_dir);
+    cache_dir = NULL;
+}
+
+
+/* hex GNU build-id from PT_NOTE segments of ELF of our own class */
+static bool
+read_build_id(int fd, char *hex, size_t hexsize)
+{
+    ElfW(Ehdr) eh;
+    int i;
+
+    if (pread(fd, &eh, sizeof(eh), 0) != sizeof(eh) ||
+        memcmp(eh.e_ident, ELFMAG, SELFMAG) || eh.e_ident[EI_CLASS] != NATIVE_ELFCLASS ||
+        eh.e_phentsize != sizeof(ElfW(Phdr)))
+    {
+        return false;
+    }
+
+    for (i = 0; i < eh.e_phnum; i++) {
+        ElfW(Phdr) ph;
+        char *notes;
+        size_t off = 0;
+
+        if (pread(fd, &ph, sizeof(ph), eh.e_phoff + i * sizeof(ph)) != sizeof(ph))
+            return false;
+        if (ph.p_type != PT_NOTE || ph.p_filesz > MAX_NOTES_SIZE)
+            continue;
+
+        notes = (char *)malloc(ph.p_filesz);
+        if (!notes || pread(fd, notes, ph.p_filesz, ph.p_offset) != (ssize_t)ph.p_filesz) {
+            free(notes);
+            continue;
+        }
+
+        while (off + sizeof(ElfW(Nhdr)) <= ph.p_filesz) {
+            const ElfW(Nhdr) *nh = (const ElfW(Nhdr) *)(notes + off);
+            size_t name_off = off + sizeof(ElfW(Nhdr)),
+                   desc_off = name_off + ((nh->n_namesz + 3) & ~3);
+
+            if (desc_off + nh->n_descsz > ph.p_filesz)
+                break;
+
+            if (nh->n_type == NT_GNU_BUILD_ID && nh->n_namesz == 4 &&
+                !memcmp(notes + name_off, "GNU", 4) && nh->n_descsz * 2 < hexsize)
+            {
+                const unsigned char *id = (const unsigned char *)notes + desc_off;
+                unsigned j, len = nh->n_descsz;
+
+                for (j = 0; j < len; j++)
+                    sprintf(hex + j*2, "%02x", id[j]);
+                free(notes);
+                return len > 0;
+            }
+            off = desc_off + ((nh->n_descsz + 3) & ~3);
+        }
+        free(notes);
+    }
+
+    return false;
+}
+
+
+/* path of cache file for given ELF, false if cache is disabled */
+static bool
+cache_path(const char *elfpath, bool dynamic, char *path, size_t size)
+{
+    char build_id[130];
+    struct stat st;
+    int fd;
+    bool has_id;
+
+    if (!cache_dir)
+        return false;
+
+    fd = open(elfpath, O_RDONLY);
+    if (fd == -1)
+        return false;
+
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return false;
+    }
+    has_id = read_build_id(fd, build_id, sizeof(build_id));
+    close(fd);
+
+    if (has_id)
+        snprintf(path, size, "%s/%s.%s", cache_dir, build_id, dynamic ? "dynsym" : "symtab");
+    else
+        snprintf(path, size, "%s/%llx-%llx-%llx-%llx.%s", cache_dir,
+            (unsigned long long)st.st_dev, (unsigned long long)st.st_ino,
+            (unsigned long long)st.st_mtime, (unsigned long long)st.st_size,
+            dynamic ? "dynsym" : "symtab");
+
+    return true;
+}
+
+
+/*
+ * Map cached symbols of ELF. Names point into mapping, so it must be
+ * kept until symbols are used (see symcache_unmap).
+ */
+bool
+symcache_load(const char *elfpath, bool dynamic, symcache_map *scm,
+              fn_descr **psyms, int *pnsyms)
+{
+    char path[PATH_MAX];
+    const struct symcache_header *hdr;
+    const struct symcache_entry *entries;
+    const char *strtab;
+    struct stat st;
+    fn_descr *syms;
+    uint32_t i;
+    int fd;
+
+    if (!cache_path(elfpath, dynamic, path, sizeof(path)))
+        return false;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return false;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(*hdr)) {
+        close(fd);
+        return false;
+    }
+
+    scm->size = st.st_size;
+    scm->addr = mmap(NULL, scm->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (scm->addr == MAP_FAILED) {
+        scm->addr = NULL;
+        return false;
+    }
+
+    hdr = (const struct symcache_header *)scm->addr;
+    entries = (const struct symcache_entry *)(hdr + 1);
+    strtab = (const char *)(entries + hdr->nentries);
+    if (memcmp(hdr->magic, SYMCACHE_MAGIC, sizeof(hdr->magic)) ||
+        sizeof(*hdr) + (uint64_t)hdr->nentries * sizeof(*entries) + hdr->strtab_size != scm->size ||
+        (hdr->strtab_size && strtab[hdr->strtab_size - 1] != '\0'))
+    {
+        symcache_unmap(scm);
+        return false;
+    }
+
+    syms = (fn_descr *)malloc(sizeof(fn_descr) * (hdr->nentries + 1));
+    if (!syms) {
+        symcache_unmap(scm);
+        return false;
+    }
+
+    for (i = 0; i < hdr->nentries; i++) {
+        if (entries[i].name >= hdr->strtab_size) {
+            free(syms);
+            symcache_unmap(scm);
+            return false;
+        }
+        syms[i].name = (char *)strtab + entries[i].name;
+        syms[i].addr = entries[i].value;
+        syms[i].len  = entries[i].size;
+        syms[i].id   = -1;
+    }
+
+    *psyms = syms;
+    *pnsyms = hdr->nentries;
+    return true;
+}
+
+
+void
+symcache_unmap(symcache_map *scm)
+{
+    if (scm->addr) {
+        munmap(scm->addr, scm->size);
+        scm->addr = NULL;
+    }
+}
+
+
+/* store symbols read from ELF (not relocated); errors are ignored */
+void
+symcache_save(const char *elfpath, bool dynamic, const fn_descr *syms, int nsyms)
+{
+    char path[PATH_MAX], tmppath[PATH_MAX + 32];
+    struct symcache_header hdr;
+    struct symcache_entry entry;
+    FILE *f;
+    int i, fd;
+
+    if (!cache_path(elfpath, dynamic, path, sizeof(path)))
+        return;
+
+    /* unique name: same ELF may be saved by several loading threads */
+    snprintf(tmppath, sizeof(tmppath), "%s.XXXXXX", path);
+    fd = mkstemp(tmppath);
+    if (fd == -1)
+        return;
+    (void)fchmod(fd, 0644);
+    f = fdopen(fd, "w");
+    if (!f) {
+        close(fd);
+        unlink(tmppath);
+        return;
+    }
+
+    memcpy(hdr.magic, SYMCACHE_MAGIC, sizeof(hdr.magic));
+    hdr.nentries = nsyms;
+    hdr.strtab_size = 0;
+    for (i = 0; i < nsyms; i++)
+        hdr.strtab_size += strlen(syms[i].name) + 1;
+    fwrite(&hdr, sizeof(hdr), 1, f);
+
+    entry.name = 0;
+    for (i = 0; i < nsyms; i++) {
+        entry.value = syms[i].addr;
+        entry.size = syms[i].len;
+        fwrite(&entry, sizeof(entry), 1, f);
+        entry.name += strlen(syms[i].name) + 1;
+    }
+
+    for (i = 0; i < nsyms; i++)
+        fwrite(syms[i].name, strlen(syms[i].name) + 1, 1, f);
+
+    /* rename is atomic: concurrent crxprof's never see partial file */
+    if (ferror(f)) {
+        fclose(f);
+        unlink(tmppath);
+    }
+    else if (fclose(f) != 0 || rename(tmppath, path) != 0)
+        unlink(tmppath);
+}
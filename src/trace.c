@@ -1,39 +1,28 @@
 #define _XOPEN_SOURCE 600
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* process_vm_readv */
+#endif
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/ptrace.h>
+#include <sys/uio.h>
+#include <sys/user.h>
 #include <endian.h>
 #include <assert.h>
 #include <string.h>
 #include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <err.h>
 #include "crxprof.h"
 
 #include <libunwind-ptrace.h>
 
-static const fn_descr *
-lookup_fn_descr(unsigned long ip)
-{
-    int l = 0, h = g_nfndescr;
-
-    while(l < h) {
-        int i = (l + h)/2;
-        if (ip < g_fndescr[i].addr) {
-            h = i;
-        }
-        else if (ip >= (g_fndescr[i].addr + g_fndescr[i].len))
-            l = i + 1;
-        else
-            return &g_fndescr[i];
-    }
-
-    return NULL;
-}
+#define FP_WINDOW_PAGES 16   /* stack is read by such pieces */
 
 static bool
 read_cmdline(pid_t pid, char **pcmdline) {
@@ -97,130 +86,299 @@ badret:
     return false;
 }
 
+/* free tracing resources, but keep profile */
+static void
+release_thread(thread_context *thr) {
+    if (thr->unwind_rctx) {
+        rmem_destroy(thr->unwind_rctx);
+        thr->unwind_rctx = NULL;
+    }
+    free_process_time(&thr->ptime);
+    perf_close_thread(thr);
+}
+
+
 bool
-trace_init(pid_t pid, ptrace_context *ctx) {
+trace_init(pid_t pid, crxprof_method method, ptrace_context *ctx) {
     ctx->pid = pid;
+    ctx->prof_method = method;
+    ctx->started = time(NULL);
+    stackrec_init(&ctx->raw);
 
     if (!read_cmdline(pid, &ctx->cmdline))
         return false;
 
-    ctx->addr_space = unw_create_addr_space(&_UPT_accessors, __BYTE_ORDER);
+    ctx->addr_space = unw_create_addr_space(rmem_accessors(), __BYTE_ORDER);
     if (!ctx->addr_space)
         return false;
 
     unw_set_caching_policy(ctx->addr_space, UNW_CACHE_GLOBAL);
-    ctx->unwind_rctx = _UPT_create(ctx->pid);
-    if (!ctx->unwind_rctx)
-        return false;
-
-    sprintf(ctx->procstat_path, "/proc/%d/stat", pid);
     return true;
 }
 
 
 void
 trace_free(ptrace_context *ctx) {
-    _UPT_destroy(ctx->unwind_rctx);
+    int i;
+
+    for (i = 0; i < ctx->nthreads; i++) {
+        thread_context *thr = ctx->threads[i];
+
+        if (!thr->exited)
+            release_thread(thr);
+        calltree_destroy(&thr->tree);
+        free(thr);
+    }
+    free(ctx->threads);
+
     unw_destroy_addr_space(ctx->addr_space);
     free(ctx->cmdline);
+    stackrec_destroy(&ctx->raw);
 }
 
 
-bool
-get_backtrace(ptrace_context *ctx) {
-    trace_stack *pstk = &ctx->stk;
-    unw_cursor_t cursor;
-    pstk->depth = 0;
+thread_context *
+trace_add_thread(ptrace_context *ctx, pid_t tid) {
+    thread_context *thr, **threads;
+    int errc;
 
-    if (unw_init_remote(&cursor, ctx->addr_space, ctx->unwind_rctx))
-        return false;
+    thr = (thread_context *)calloc(1, sizeof(thread_context));
+    if (!thr)
+        return NULL;
 
-    do {
-        unw_get_reg(&cursor, UNW_REG_IP, &pstk->ips[pstk->depth++]);
-    } while (pstk->depth < MAX_STACK_DEPTH && unw_step(&cursor) > 0);
+    thr->tid = tid;
+    thr->perf_fd = -1;
+    thr->ptime.schedstat_fd = -1;
+    calltree_init(&thr->tree);
 
-    return true;
+    if (ctx->use_perf) {
+        if (!perf_open_thread(ctx, thr)) {
+            free(thr);
+            return NULL;
+        }
+    }
+    else {
+        if (!reset_thread_time(&thr->ptime, ctx->pid, tid, ctx->prof_method, &errc)) {
+            free(thr);
+            errno = errc;
+            return NULL;
+        }
+
+        thr->unwind_rctx = rmem_create(tid);
+        if (!thr->unwind_rctx) {
+            free_process_time(&thr->ptime);
+            free(thr);
+            return NULL;
+        }
+    }
+
+    threads = (thread_context **)realloc(ctx->threads, 
+        sizeof(thread_context *) * (ctx->nthreads + 1));
+    if (!threads) {
+        release_thread(thr);
+        free(thr);
+        return NULL;
+    }
+
+    sprintf(thr->procstat_path, "/proc/%d/task/%d/stat", ctx->pid, tid);
+    ctx->threads = threads;
+    ctx->threads[ctx->nthreads++] = thr;
+    return thr;
 }
 
 
-bool
-fill_backtrace(uint64_t cost, const trace_stack *stk, 
-               calltree_node **root)
-{
-    calltree_node *parent = NULL;
-    int depth = stk->depth - 1;
+thread_context *
+trace_find_thread(const ptrace_context *ctx, pid_t tid) {
+    int i;
 
-    if (stk->depth <= 0 || stk->depth >= MAX_STACK_DEPTH) {
-        // too small size of ips. So, we don't have start frame here.
-        // Simply ignore
-        return false;
+    for (i = 0; i < ctx->nthreads; i++) {
+        if (ctx->threads[i]->tid == tid && !ctx->threads[i]->exited)
+            return ctx->threads[i];
     }
 
-    while (depth >= 0) {
-        const fn_descr *pfn = lookup_fn_descr(stk->ips[depth--]);
-        if (pfn) {
-            if (parent) {
-                calltree_node *this_node = NULL;
-                int i;
-
-                for (i = 0; i < parent->nchilds; i++)
-                    if (parent->childs[i].pfn == pfn) {
-                        this_node = &parent->childs[i];
-                        break;
-                    }
-
-                if (!this_node) {
-                    parent->childs = (calltree_node *)realloc(parent->childs, 
-                        sizeof(calltree_node) * ++parent->nchilds);
-                    this_node = &parent->childs[parent->nchilds - 1];
-                    memset(this_node, 0, sizeof(calltree_node));
-                    this_node->pfn = pfn;
-                }
-
-                parent->nintermediate += cost;
-                parent = this_node;
-            }
-            else {
-                if (!*root) {
-                    *root = calloc(1, sizeof(calltree_node));
-                    assert(*root);
-                    (*root)->pfn = pfn;
-                    parent = *root;
-                }
-                else if (pfn == (*root)->pfn)
-                    parent = *root;
+    return NULL;
+}
+
+
+/* 
+ * Thread is gone, but it's profile still interesting.
+ * So keep it unless there is nothing to show.
+ */
+void
+trace_thread_exited(ptrace_context *ctx, thread_context *thr) {
+    int i;
+
+    release_thread(thr);
+    thr->exited = true;
+
+    if (!thr->tree.root && !thr->nsnaps) {
+        for (i = 0; i < ctx->nthreads; i++) {
+            if (ctx->threads[i] == thr) {
+                ctx->threads[i] = ctx->threads[--ctx->nthreads];
+                break;
             }
         }
+        free(thr);
     }
+}
 
-    if (parent)
-        parent->nself += cost;
 
-    return true;
+/* forget profile collected so far, exited threads too: next --window */
+void
+trace_reset(ptrace_context *ctx)
+{
+    int i = 0;
+
+    while (i < ctx->nthreads) {
+        thread_context *thr = ctx->threads[i];
+
+        calltree_destroy(&thr->tree);
+        thr->nsnaps = thr->nsnaps_accounted = 0;
+        if (thr->exited) {
+            ctx->threads[i] = ctx->threads[--ctx->nthreads];
+            free(thr);
+        }
+        else
+            i++;
+    }
+
+    stackrec_destroy(&ctx->raw);
+    stackrec_init(&ctx->raw);
+    ctx->nsnaps = ctx->nsnaps_accounted = 0;
+    memset(ctx->ndropped, 0, sizeof(ctx->ndropped));
+    ctx->nfp_fallbacks = 0;
+    ctx->started = time(NULL);
 }
 
-static void
-calltree_destroy_childs(calltree_node *root) {
-    if (root->nchilds) {
-        int i;
-        for (i = 0; i < root->nchilds; i++) {
-            calltree_destroy_childs(&root->childs[i]);
+
+/* read remote stack from `addr' page by page until fault (or window end) */
+static size_t
+read_stack_window(pid_t tid, unsigned long addr, unsigned long *buf, size_t bufsize)
+{
+    struct iovec local, remote[FP_WINDOW_PAGES + 1];
+    unsigned long pagesize = sysconf(_SC_PAGESIZE), p = addr, end = addr + bufsize;
+    int n = 0;
+    ssize_t nread;
+
+    /* no partial transfers inside of iovec: fault in last page shouldn't lose others */
+    while (p < end && n < FP_WINDOW_PAGES + 1) {
+        unsigned long next = (p & ~(pagesize - 1)) + pagesize;
+        if (next > end)
+            next = end;
+
+        remote[n].iov_base = (void *)p;
+        remote[n].iov_len = next - p;
+        n++;
+        p = next;
+    }
+
+    local.iov_base = buf;
+    local.iov_len = bufsize;
+    nread = process_vm_readv(tid, &local, 1, remote, n, 0);
+    return (nread < 0) ? 0 : nread;
+}
+
+
+/*
+ * Walk frame-pointer chain on stack read in bulk.
+ * Returns false if chain looks broken (code without frame pointers):
+ * every next frame must be above previous one, and return addresses
+ * have to point into executable mappings. Only ranges of mappings are
+ * checked: symbols are loaded after thread is resumed. Chain may end
+ * with garbage only in outermost frame (libc built without frame
+ * pointers calls main).
+ */
+static bool
+get_backtrace_fp(ptrace_context *ctx, thread_context *thr) {
+#if defined(__x86_64__) || defined(__i386__)
+    static unsigned long stack[FP_WINDOW_PAGES * 4096 / sizeof(unsigned long)];
+    trace_stack *pstk = &ctx->stk;
+    struct user_regs_struct regs;
+    unsigned long fp, base, nwords;
+
+    if (ptrace(PTRACE_GETREGS, thr->tid, 0, &regs) == -1)
+        return false;
+
+#if defined(__x86_64__)
+    pstk->ips[0] = regs.rip;
+    fp   = regs.rbp;
+    base = regs.rsp;
+#else
+    pstk->ips[0] = regs.eip;
+    fp   = regs.ebp;
+    base = regs.esp;
+#endif
+    pstk->depth = 1;
+    nwords = read_stack_window(thr->tid, base, stack, sizeof(stack)) / sizeof(unsigned long);
+
+    while (pstk->depth < MAX_STACK_DEPTH) {
+        unsigned long i, next;
+
+        if (fp == 0)
+            return true;  /* outermost frame */
+
+        if (fp < base || fp % sizeof(unsigned long))
+            return pstk->depth > 1 && find_module(pstk->ips[pstk->depth - 1]);
+
+        i = (fp - base) / sizeof(unsigned long);
+        if (i + 1 >= nwords) {
+            /* frame is out of window: read next piece of stack */
+            base = fp;
+            i = 0;
+            nwords = read_stack_window(thr->tid, base, stack, sizeof(stack)) / sizeof(unsigned long);
+            if (nwords < 2)
+                return false;
         }
-        free(root->childs);
+
+        next = stack[i];
+        if (stack[i + 1] == 0)
+            return true;
+
+        /* caller of the previous frame is also a frame to continue */
+        if (pstk->depth > 1 && !find_module(pstk->ips[pstk->depth - 1]))
+            return false;
+
+        pstk->ips[pstk->depth++] = stack[i + 1];
+        if (next != 0 && next <= fp)
+            return find_module(pstk->ips[pstk->depth - 2]) != NULL;
+        fp = next;
     }
+
+    return true;
+#else
+    return false; /* frame layout is unknown */
+#endif
 }
 
 
-void
-calltree_destroy(calltree_node *root) {
-    calltree_destroy_childs(root);
-    free(root);
+bool
+get_backtrace(ptrace_context *ctx, thread_context *thr) {
+    trace_stack *pstk = &ctx->stk;
+    unw_cursor_t cursor;
+
+    if (ctx->unwind_method == UNWIND_FP) {
+        if (get_backtrace_fp(ctx, thr))
+            return true;
+        ctx->nfp_fallbacks++;
+    }
+
+    pstk->depth = 0;
+
+    if (unw_init_remote(&cursor, ctx->addr_space, rmem_begin(thr->unwind_rctx)))
+        return false;
+
+    do {
+        unw_get_reg(&cursor, UNW_REG_IP, &pstk->ips[pstk->depth++]);
+    } while (pstk->depth < MAX_STACK_DEPTH && unw_step(&cursor) > 0);
+
+    return true;
 }
 
+
 char
-get_procstate(const ptrace_context *ctx) {
+get_procstate(const thread_context *thr) {
     char ret = 0;
-    int fd = open(ctx->procstat_path, O_RDONLY);
+    int fd = open(thr->procstat_path, O_RDONLY);
 
     if (fd != -1) {
         static char buf[64];
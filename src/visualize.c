@@ -1,13 +1,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <err.h>
 #include "crxprof.h"
 
 static int
-nodes_weight_cmp(const calltree_node *a, const calltree_node *b)
+nodes_weight_cmp(const calltree_node **pa, const calltree_node **pb)
 {
-    uint64_t acost = (a->nintermediate + a->nself),
-             bcost = (b->nintermediate + b->nself);
+    uint64_t acost = ((*pa)->nintermediate + (*pa)->nself),
+             bcost = ((*pb)->nintermediate + (*pb)->nself);
 
     return (bcost == acost) ? 0 : 
          ( (bcost  > acost) ? 1 : -1 );
@@ -41,13 +42,13 @@ typedef struct visualize_info_struct {
 
 
 static int
-count_visible_childs(const calltree_node *node,
+count_visible_childs(calltree_node **sorted, int nchilds,
                      uint64_t total_cost, double min_cost)
 {
     int i;
 
-    for(i = 0; i < node->nchilds; i++) {
-        if (get_node_cost(&node->childs[i], total_cost) < min_cost)
+    for(i = 0; i < nchilds; i++) {
+        if (get_node_cost(sorted[i], total_cost) < min_cost)
             break;
     }
 
@@ -69,19 +70,28 @@ show_layer(visualize_info *vi,
         printf(" \\_ ");
     }
 
-    printf("%.60s (%.1f%% | %.1f%% self)\n", node->pfn->name, percent_full, percent_self);
+    printf("%.60s (%.1f%% | %.1f%% self)\n", fn_name(node->pfn), percent_full, percent_self);
     if (node->nchilds) {
-        qsort(node->childs, node->nchilds,
-              sizeof(calltree_node),
+        /* childs themselves are indexed by calltree: sort pointers */
+        calltree_node **sorted = malloc(sizeof(calltree_node *) * node->nchilds);
+        int nvis, i;
+
+        if (!sorted)
+            err(1, "Failed to allocate %d nodes", node->nchilds);
+        for (i = 0; i < node->nchilds; i++)
+            sorted[i] = &node->childs[i];
+        qsort(sorted, node->nchilds,
+              sizeof(calltree_node *),
               (qsort_compar_t)nodes_weight_cmp);
 
         if (depth > 0)
             memcpy(&vi->prefix[(depth-1)*VIS_PADDING], is_last ? "    " : " |  ", VIS_PADDING);
 
-        int nvis = count_visible_childs(node, vi->total_cost, vi->vprops->min_cost), i;
+        nvis = count_visible_childs(sorted, node->nchilds, vi->total_cost, vi->vprops->min_cost);
         for (i = 0; i < nvis; i++) {
-            show_layer(vi, &node->childs[i], depth + 1, i+1 == nvis);
+            show_layer(vi, sorted[i], depth + 1, i+1 == nvis);
         }
+        free(sorted);
     }
 }
 
@@ -97,7 +107,11 @@ visualize_profile(calltree_node *root, const vproperties *vprops)
 
         vi.vprops = vprops;
         vi.total_cost = total_cost;
-       
+
+        /* synthetic root is worth showing only if there are several roots */
+        if (start->nchilds == 1)
+            start = &start->childs[0];
+
         /* skip uninsterested start-functions */
         if (!vprops->print_fullstack) {
             while (!start->nself && start->nchilds == 1)
@@ -107,3 +121,134 @@ visualize_profile(calltree_node *root, const vproperties *vprops)
         show_layer(&vi, start, 0, false);
     }
 }
+
+
+/* IP of function accumulated over all nodes of it */
+typedef struct {
+    const fn_descr *pfn;
+    unsigned long addr;
+    unsigned line;
+    uint64_t cost;
+} instr_cost;
+
+typedef struct {
+    instr_cost *instrs;
+    int ninstrs;
+    int size;
+} instr_list;
+
+typedef struct {
+    int first, n;   /* in instr_list */
+    uint64_t cost;
+} fn_instrs;
+
+
+static void
+collect_instrs(const calltree_node *node, instr_list *il)
+{
+    int i;
+
+    for (i = 0; i < node->nselfpos; i++) {
+        if (il->ninstrs == il->size) {
+            il->size = il->size ? il->size * 2 : 256;
+            il->instrs = (instr_cost *)realloc(il->instrs, sizeof(instr_cost) * il->size);
+            if (!il->instrs)
+                err(1, "Failed to allocate %d instructions", il->size);
+        }
+        il->instrs[il->ninstrs].pfn  = node->pfn;
+        il->instrs[il->ninstrs].addr = node->selfpos[i].addr;
+        il->instrs[il->ninstrs].line = node->selfpos[i].line;
+        il->instrs[il->ninstrs++].cost = node->selfpos[i].cost;
+    }
+
+    for (i = 0; i < node->nchilds; i++)
+        collect_instrs(&node->childs[i], il);
+}
+
+
+static int
+instr_cmp(const instr_cost *a, const instr_cost *b)
+{
+    if (a->pfn != b->pfn)
+        return (a->pfn->id < b->pfn->id) ? -1 : 1;
+    return (a->addr == b->addr) ? 0 : (a->addr < b->addr ? -1 : 1);
+}
+
+
+static int
+fn_instrs_cmp(const fn_instrs *a, const fn_instrs *b)
+{
+    return (a->cost == b->cost) ? 0 : (a->cost < b->cost ? 1 : -1);
+}
+
+
+/*
+ * Hot instructions of functions taking at least min_cost% of time self.
+ * Addresses are ones of ELF file to match `objdump -d' output.
+ */
+void
+annotate_instr(calltree_node *root, const vproperties *vprops)
+{
+    uint64_t total_cost = count_calls(root);
+    instr_list il = { NULL, 0, 0 };
+    fn_instrs *fns;
+    int i, j, n = 0, nfns = 0;
+
+    collect_instrs(root, &il);
+    if (!il.ninstrs || !total_cost) {
+        free(il.instrs);
+        return;
+    }
+
+    /* merge same IPs met in different nodes */
+    qsort(il.instrs, il.ninstrs, sizeof(instr_cost), (qsort_compar_t)instr_cmp);
+    for (i = 1; i < il.ninstrs; i++) {
+        if (instr_cmp(&il.instrs[n], &il.instrs[i]) == 0)
+            il.instrs[n].cost += il.instrs[i].cost;
+        else
+            il.instrs[++n] = il.instrs[i];
+    }
+    il.ninstrs = n + 1;
+
+    fns = (fn_instrs *)malloc(sizeof(fn_instrs) * il.ninstrs);
+    if (!fns)
+        err(1, "Failed to allocate %d functions", il.ninstrs);
+    for (i = 0; i < il.ninstrs; i++) {
+        if (i == 0 || il.instrs[i].pfn != il.instrs[i-1].pfn) {
+            fns[nfns].first = i;
+            fns[nfns].n = 0;
+            fns[nfns++].cost = 0;
+        }
+        fns[nfns-1].n++;
+        fns[nfns-1].cost += il.instrs[i].cost;
+    }
+    qsort(fns, nfns, sizeof(fn_instrs), (qsort_compar_t)fn_instrs_cmp);
+
+    for (i = 0; i < nfns; i++) {
+        const instr_cost *first = &il.instrs[fns[i].first];
+        const fn_module *mod;
+
+        if ((double)fns[i].cost * 100.0 / total_cost < vprops->min_cost)
+            break;
+
+        mod = fn_module_of(first->pfn);
+        if (!mod) /* inlined one */
+            mod = find_module(first->addr);
+
+        printf("%.60s (%.1f%% self) in %s\n", fn_name(first->pfn),
+            (double)fns[i].cost * 100.0 / total_cost, mod ? mod->path : "??");
+
+        for (j = 0; j < fns[i].n; j++) {
+            const instr_cost *ic = &first[j];
+            unsigned long elf_addr = mod ? module_elf_addr(mod, ic->addr) : ic->addr;
+
+            printf("    %5.1f%%  %8lx", (double)ic->cost * 100.0 / fns[i].cost, elf_addr);
+            if (ic->line)
+                printf("  line %u", ic->line);
+            printf("\n");
+        }
+    }
+
+    free(fns);
+    free(il.instrs);
+}
@@ -0,0 +1,106 @@
+/*
+ * window.c
+ * Ring of last time windows of profile (--window): every window is kept
+ * packed, the oldest one is dropped when ring is full. Symbols which
+ * no window refers any more are freed then, see window_reclaim().
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include "crxprof.h"
+
+
+void
+window_ring_init(window_ring *ring, int size)
+{
+    memset(ring, 0, sizeof(window_ring));
+    ring->size = size;
+    ring->windows = (profile_window *)calloc(size, sizeof(profile_window));
+    if (!ring->windows)
+        err(1, "Failed to allocate %d windows", size);
+}
+
+
+void
+window_push(window_ring *ring, const ptrace_context *ctx, const calltree *tree,
+            time_t start, time_t end)
+{
+    profile_window *w;
+
+    if (ring->count == ring->size) {
+        w = &ring->windows[ring->first];
+        free(w->nodes);
+        ring->first = (ring->first + 1) % ring->size;
+        ring->count--;
+    }
+
+    w = &ring->windows[(ring->first + ring->count) % ring->size];
+    w->nodes = calltree_pack(tree, &w->nnodes);
+    w->start = start;
+    w->end = end;
+    w->nsnaps = ctx->nsnaps;
+    w->nsnaps_accounted = ctx->nsnaps_accounted;
+    memcpy(w->ndropped, ctx->ndropped, sizeof(w->ndropped));
+
+    ring->count++;
+    ring->nsnaps_closed += ctx->nsnaps;
+}
+
+
+/* profile of all windows in ring: added to `tree', counters to `view' */
+void
+window_merge(const window_ring *ring, ptrace_context *view, calltree *tree)
+{
+    int i, j;
+
+    if (ring->count)
+        view->started = ring->windows[ring->first].start;
+
+    for (i = 0; i < ring->count; i++) {
+        const profile_window *w = &ring->windows[(ring->first + i) % ring->size];
+
+        (void)calltree_unpack(tree, w->nodes, w->nnodes);
+        view->nsnaps += w->nsnaps;
+        view->nsnaps_accounted += w->nsnaps_accounted;
+        for (j = 0; j < NDROP_REASONS; j++)
+            view->ndropped[j] += w->ndropped[j];
+    }
+}
+
+
+/*
+ * Free functions of unloaded modules, redefined JIT ones etc which windows
+ * kept don't refer. Called when current calltree is packed and destroyed:
+ * nothing else refers them.
+ */
+void
+window_reclaim(const window_ring *ring)
+{
+    char *used = (char *)calloc(g_nfndescr + 1, 1);
+    int i, j;
+
+    if (!used)
+        err(1, "Failed to allocate %d functions", g_nfndescr);
+
+    for (i = 0; i < ring->count; i++) {
+        const profile_window *w = &ring->windows[(ring->first + i) % ring->size];
+
+        for (j = 0; j < w->nnodes; j++)
+            used[w->nodes[j].pfn->id] = 1;
+    }
+
+    reclaim_fndescr(used);
+    free(used);
+}
+
+
+void
+window_ring_free(window_ring *ring)
+{
+    int i;
+
+    for (i = 0; i < ring->count; i++)
+        free(ring->windows[(ring->first + i) % ring->size].nodes);
+    free(ring->windows);
+    memset(ring, 0, sizeof(window_ring));
+}